@@ -0,0 +1,138 @@
+/*
+ * bench.c - Time repeated trials of a function f with the monotonic clock,
+ *     whatever timing method config.h selects for fsecs, and summarize
+ *     them by their mean, standard deviation and a 95% confidence
+ *     interval of the mean, with the caches warm or cold.
+ *
+ * A cold run follows a pass writing and then reading a buffer larger than
+ * the last level cache, which evicts the data of the previous run. The
+ * calling thread can be pinned to a CPU, so that the trials neither
+ * migrate nor share a core with the other runs of the host scheduler.
+ * Elsewhere than on Linux pinning fails.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "bench.h"
+
+/* Bytes swept to evict the caches before a cold run */
+#define FLUSH_BYTES (64 << 20)
+
+/* Two-sided 95% quantiles of Student's t with 1 to 30 degrees of freedom */
+static const double t95[30] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static volatile unsigned char *flush_buf = NULL;
+
+/*
+ * now - Return the monotonic clock in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * flush - Evict the caches by writing and reading FLUSH_BYTES bytes
+ */
+static void flush(void)
+{
+    unsigned int sum = 0;
+    size_t i;
+
+    if (flush_buf == NULL && (flush_buf = malloc(FLUSH_BYTES)) == NULL) {
+	fprintf(stderr, "Fatal error.  Malloc returned null when trying to flush the caches\n");
+	exit(1);
+    }
+    for (i = 0; i < FLUSH_BYTES; i += 64)
+	flush_buf[i] = (unsigned char)i;
+    for (i = 0; i < FLUSH_BYTES; i += 64)
+	sum += flush_buf[i];
+    flush_buf[0] = (unsigned char)sum;
+}
+
+/*
+ * bench_cpus - Store the CPUs the calling thread may run on in cpus, up
+ *     to max of them. Return their number, 0 if the system cannot tell.
+ */
+int bench_cpus(int *cpus, int max)
+{
+    int n = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+	return 0;
+    for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+	if (CPU_ISSET(cpu, &set))
+	    cpus[n++] = cpu;
+#endif
+    return n;
+}
+
+/*
+ * bench_pin - Pin the calling thread to cpu. Return 0, or -1 if the
+ *     system cannot.
+ */
+int bench_pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+	return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * bench_run - Time n runs of f(argp), warm or cold, and summarize them
+ *     in *b.
+ */
+void bench_run(bench_test_funct f, void *argp, int n, int warm, bench_t *b)
+{
+    double start, secs, delta, m2 = 0;
+    int i;
+
+    b->trials = n;
+    b->mean = b->min = b->max = 0;
+    if (warm)
+	f(argp);
+    for (i = 0; i < n; i++) {
+	if (!warm)
+	    flush();
+	start = now();
+	f(argp);
+	secs = now() - start;
+
+	/* Welford's update of the mean and the sum of squared deviations */
+	delta = secs - b->mean;
+	b->mean += delta / (i + 1);
+	m2 += delta * (secs - b->mean);
+	if (i == 0 || secs < b->min)
+	    b->min = secs;
+	if (i == 0 || secs > b->max)
+	    b->max = secs;
+    }
+
+    /* Beyond the table, t approaches the normal quantile as z + (z^3 + z) / 4df */
+    b->stddev = n > 1 ? sqrt(m2 / (n - 1)) : 0;
+    b->ci95 = n > 1 ? (n - 1 <= 30 ? t95[n - 2] : 1.96 + 2.372 / (n - 1)) *
+	b->stddev / sqrt(n) : 0;
+}
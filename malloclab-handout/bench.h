@@ -0,0 +1,27 @@
+/*
+ * bench.h - prototypes for the routines in bench.c that time repeated
+ *     trials of a test function f and summarize them
+ */
+typedef void (*bench_test_funct)(void *);
+
+/* Summary of the trials of a test function, in seconds per run */
+typedef struct {
+    int trials;      /* number of timed runs */
+    double mean;     /* mean running time */
+    double stddev;   /* sample standard deviation of the running time */
+    double ci95;     /* half width of the 95% confidence interval of the mean */
+    double min;      /* fastest run */
+    double max;      /* slowest run */
+} bench_t;
+
+/* Store the CPUs the calling thread may run on in cpus, at most max of
+   them, and return how many. Return 0 where they are unknown */
+int bench_cpus(int *cpus, int max);
+
+/* Pin the calling thread to cpu. Return 0, or -1 if it cannot be */
+int bench_pin(int cpu);
+
+/* Time n runs of f(argp) into *b. With warm set, an untimed run comes
+   first and the runs follow one another; otherwise the caches are
+   evicted before each run */
+void bench_run(bench_test_funct f, void *argp, int n, int warm, bench_t *b);
@@ -0,0 +1,494 @@
+/*
+ * capture.c - Record the allocation calls of a running program as a trace for mdriver.
+ *     Load it with LD_PRELOAD; the C library malloc still serves every call. Build it
+ *     with "make libmmtrace.so":
+ *
+ *     unix> MMTRACE=server.rep LD_PRELOAD=./libmmtrace.so ./server
+ *
+ *     Each block takes the next id when it is allocated and keeps it through realloc.
+ *     The requests go to MMTRACE.ops as they come, and at exit the blocks still live
+ *     are freed, so that the trace is balanced, and the trace is written to MMTRACE
+ *     (mmtrace-%p.rep by default): in the binary format of tracebin.h if the name
+ *     ends in ".bin", else as a .rep file. A "%p" in the name stands for the process
+ *     id; without one, the programs that the program runs, which load the shim as
+ *     well, write over its trace. A process that ends without exit, as by a signal,
+ *     leaves only MMTRACE.ops.
+ *
+ *     Zero sizes are recorded as 1 byte, as mdriver takes none, and memalign and the
+ *     like as plain allocations. Reallocs are serialized, so that no other thread gets
+ *     the old block before the move is recorded. A child after fork records nothing.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "tracebin.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* The C library allocator, under the names glibc keeps for it */
+extern void* __libc_malloc(size_t size);
+extern void __libc_free(void* ptr);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t align, size_t size);
+
+#define MAXPATH 4096
+#define MINFD 512		/* Lowest descriptor of MMTRACE.ops, out of the way of the program */
+#define BUFSIZE (1 << 16)	/* Bytes of requests written at once */
+#define MINSLOTS 4096		/* First size of the block table */
+
+/* Live block of the table: address, id and size */
+typedef struct {
+	void* ptr;
+	unsigned int id;
+	size_t size;
+} slot_t;
+
+/* 1 while recording. The rest is under lockword. */
+static int capturing;
+static unsigned int lockword;
+
+static char path[MAXPATH], opspath[MAXPATH + 4];
+static int binary, opsfd = -1;
+static unsigned char buf[BUFSIZE];
+static size_t buflen;
+
+/* Open addressing table of the live blocks, by address, nslots a power of 2 */
+static slot_t* slots;
+static size_t nslots, nlive;
+
+static unsigned int num_ids, num_ops, last_id;
+static size_t live_bytes, peak_bytes;
+
+static void lock(void)
+{
+	while (__sync_lock_test_and_set(&lockword, 1))
+		while (*(volatile unsigned int *)&lockword)
+			sched_yield();
+}
+
+static void unlock(void)
+{
+	__sync_lock_release(&lockword);
+}
+
+/*
+ * say - Print msg on stderr, without stdio, which may allocate.
+ */
+static void say(const char* msg)
+{
+	if (write(2, "mmtrace: ", 9) < 0 || write(2, msg, strlen(msg)) < 0)
+		return;
+}
+
+/*
+ * stop - Give up recording for the reason msg.
+ */
+static void stop(const char* msg)
+{
+	say(msg);
+	capturing = 0;
+}
+
+/*
+ * flush - Write out the buffered requests.
+ */
+static void flush(void)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < buflen) {
+		if ((n = write(opsfd, buf + done, buflen - done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			stop("write failed, recording stopped\n");
+			break;
+		}
+		done += n;
+	}
+	buflen = 0;
+}
+
+/*
+ * put_uint - Write v in decimal at p, return the end of it.
+ */
+static char* put_uint(char* p, unsigned long v)
+{
+	char digits[24];
+	int n = 0;
+
+	do
+		digits[n++] = '0' + v % 10;
+	while ((v /= 10) != 0);
+	while (n > 0)
+		*p++ = digits[--n];
+	return p;
+}
+
+/*
+ * emit - Record request type (TRACEBIN_ALLOC, ...) of block id with size bytes.
+ */
+static void emit(int type, unsigned int id, size_t size)
+{
+	unsigned char* p;
+	char* q;
+
+	if (buflen + 64 > BUFSIZE)
+		flush();
+	if (binary) {
+		if (TRACEBIN_ZIGZAG(id - last_id) > TRACEBIN_MAXDELTA) {
+			stop("too many blocks for the binary format, recording stopped\n");
+			return;
+		}
+		p = tracebin_put(buf + buflen, TRACEBIN_ZIGZAG(id - last_id) << 2 | type);
+		if (type != TRACEBIN_FREE)
+			p = tracebin_put(p, size);
+		buflen = p - buf;
+	}
+	else {
+		q = (char *)buf + buflen;
+		*q++ = type == TRACEBIN_ALLOC ? 'a' : type == TRACEBIN_FREE ? 'f' : 'r';
+		*q++ = ' ';
+		q = put_uint(q, id);
+		if (type != TRACEBIN_FREE) {
+			*q++ = ' ';
+			q = put_uint(q, size);
+		}
+		*q++ = '\n';
+		buflen = (unsigned char *)q - buf;
+	}
+	last_id = id;
+	num_ops++;
+}
+
+/* Home slot of ptr */
+#define HASH(ptr) ((size_t)(((uintptr_t)(ptr) >> 4) * 2654435761u) & (nslots - 1))
+
+/*
+ * find - Return the slot of ptr, or the empty slot where it would go.
+ */
+static slot_t* find(void* ptr)
+{
+	size_t i;
+
+	for (i = HASH(ptr); slots[i].ptr != NULL && slots[i].ptr != ptr; i = (i + 1) & (nslots - 1))
+		;
+	return &slots[i];
+}
+
+/*
+ * grow - Double the block table.
+ */
+static int grow(void)
+{
+	slot_t* old = slots;
+	size_t i, n = nslots;
+	void* p;
+
+	p = mmap(NULL, 2 * n * sizeof(slot_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	slots = (slot_t *)p;
+	nslots = 2 * n;
+	for (i = 0; i < n; i++)
+		if (old[i].ptr != NULL)
+			*find(old[i].ptr) = old[i];
+	munmap(old, n * sizeof(slot_t));
+	return 0;
+}
+
+/*
+ * remove_slot - Empty slot s, moving up the blocks that probed past it.
+ */
+static void remove_slot(slot_t* s)
+{
+	size_t i = s - slots, j, home;
+
+	for (j = (i + 1) & (nslots - 1); slots[j].ptr != NULL; j = (j + 1) & (nslots - 1)) {
+		home = HASH(slots[j].ptr);
+		if (((j - home) & (nslots - 1)) >= ((j - i) & (nslots - 1))) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i].ptr = NULL;
+}
+
+/*
+ * record_alloc - Give the new block ptr of size bytes an id and record it.
+ */
+static void record_alloc(void* ptr, size_t size)
+{
+	slot_t* s;
+
+	if (2 * (nlive + 1) > nslots && grow() < 0) {
+		stop("out of memory for the block table, recording stopped\n");
+		return;
+	}
+	s = find(ptr);
+	s->ptr = ptr;
+	s->id = num_ids++;
+	s->size = size;
+	nlive++;
+	if ((live_bytes += size) > peak_bytes)
+		peak_bytes = live_bytes;
+	emit(TRACEBIN_ALLOC, s->id, size);
+}
+
+/*
+ * record_free - Record the free of ptr, if it was allocated while recording.
+ */
+static void record_free(void* ptr)
+{
+	slot_t* s = find(ptr);
+
+	if (s->ptr == NULL)
+		return;
+	emit(TRACEBIN_FREE, s->id, 0);
+	live_bytes -= s->size;
+	remove_slot(s);
+	nlive--;
+}
+
+/*
+ * record_realloc - Record the move of block ptr to newptr of size bytes. A block
+ *     allocated before recording counts as a new one.
+ */
+static void record_realloc(void* ptr, void* newptr, size_t size)
+{
+	slot_t* s = find(ptr);
+	unsigned int id;
+
+	if (s->ptr == NULL) {
+		record_alloc(newptr, size);
+		return;
+	}
+	id = s->id;
+	live_bytes += size - s->size;
+	if (newptr != ptr) {
+		remove_slot(s);
+		s = find(newptr);
+		s->ptr = newptr;
+		s->id = id;
+	}
+	s->size = size;
+	if (live_bytes > peak_bytes)
+		peak_bytes = live_bytes;
+	emit(TRACEBIN_REALLOC, id, size);
+}
+
+/* Make the record call under the lock, while recording */
+#define RECORD(call) do { if (capturing) { lock(); if (capturing) call; unlock(); } } while (0)
+
+/*
+ * stop_child - Record nothing in the child after fork.
+ */
+static void stop_child(void)
+{
+	capturing = 0;
+	lockword = 0;
+	if (opsfd >= 0)
+		close(opsfd);
+}
+
+/*
+ * capture_start - Open MMTRACE.ops and start recording, before main.
+ */
+__attribute__((constructor)) static void capture_start(void)
+{
+	const char* name = getenv("MMTRACE");
+	size_t len = 0;
+	void* p;
+	int fd;
+
+	if (name == NULL || *name == '\0')
+		name = "mmtrace-%p.rep";
+	for (; *name != '\0' && len < MAXPATH - 24; name++)
+		if (name[0] == '%' && name[1] == 'p') {
+			len = put_uint(path + len, getpid()) - path;
+			name++;
+		}
+		else
+			path[len++] = *name;
+	if (*name != '\0') {
+		say("MMTRACE too long, nothing recorded\n");
+		return;
+	}
+	path[len] = '\0';
+	memcpy(opspath, path, len);
+	memcpy(opspath + len, ".ops", 5);
+	binary = len >= 4 && strcmp(path + len - 4, ".bin") == 0;
+
+	p = mmap(NULL, MINSLOTS * sizeof(slot_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED || (fd = open(opspath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		say("could not set up, nothing recorded\n");
+		return;
+	}
+	if ((opsfd = fcntl(fd, F_DUPFD_CLOEXEC, MINFD)) >= 0)
+		close(fd);
+	else
+		opsfd = fd;
+	slots = (slot_t *)p;
+	nslots = MINSLOTS;
+	pthread_atfork(NULL, NULL, stop_child);
+	capturing = 1;
+}
+
+/*
+ * capture_end - Free the live blocks and write the trace, header first, at exit.
+ */
+__attribute__((destructor)) static void capture_end(void)
+{
+	unsigned char header[4 * TRACEBIN_MAXVARINT + 64], *p = header;
+	unsigned int h[4];
+	size_t i;
+	ssize_t n;
+	int fd, ok = 1;
+
+	lock();
+	if (!capturing) {
+		unlock();
+		return;
+	}
+	for (i = 0; i < nslots; i++)
+		if (slots[i].ptr != NULL)
+			emit(TRACEBIN_FREE, slots[i].id, 0);
+	flush();
+	capturing = 0;
+	unlock();
+
+	/* sugg_heapsize, num_ids, num_ops, weight */
+	h[0] = peak_bytes > 0xffffffffu ? 0xffffffffu : peak_bytes;
+	h[1] = num_ids;
+	h[2] = num_ops;
+	h[3] = 1;
+	if (binary) {
+		memcpy(p, TRACEBIN_MAGIC, TRACEBIN_MAGICLEN);
+		p += TRACEBIN_MAGICLEN;
+		for (i = 0; i < 4; i++)
+			p = tracebin_put(p, h[i]);
+	}
+	else
+		for (i = 0; i < 4; i++) {
+			p = (unsigned char *)put_uint((char *)p, h[i]);
+			*p++ = '\n';
+		}
+
+	/* The header, then the requests */
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		say("could not create the trace, the requests are in MMTRACE.ops\n");
+		return;
+	}
+	ok = write(fd, header, p - header) == p - header;
+	lseek(opsfd, 0, SEEK_SET);
+	while (ok && (n = read(opsfd, buf, BUFSIZE)) > 0)
+		ok = write(fd, buf, n) == n;
+	if (close(fd) < 0 || !ok) {
+		say("could not write the trace, the requests are in MMTRACE.ops\n");
+		return;
+	}
+	close(opsfd);
+	unlink(opspath);
+}
+
+EXPORT void* malloc(size_t size)
+{
+	void* p = __libc_malloc(size);
+
+	if (p != NULL)
+		RECORD(record_alloc(p, size != 0 ? size : 1));
+	return p;
+}
+
+EXPORT void free(void* ptr)
+{
+	if (ptr != NULL)
+		RECORD(record_free(ptr));
+	__libc_free(ptr);
+}
+
+EXPORT void* calloc(size_t nmemb, size_t size)
+{
+	void* p = __libc_calloc(nmemb, size);
+
+	if (p != NULL)
+		RECORD(record_alloc(p, nmemb * size != 0 ? nmemb * size : 1));
+	return p;
+}
+
+/*
+ * realloc - Under the lock while recording, from the call to the record of it.
+ */
+EXPORT void* realloc(void* ptr, size_t size)
+{
+	void* p;
+
+	if (!capturing)
+		return __libc_realloc(ptr, size);
+	lock();
+	p = __libc_realloc(ptr, size);
+	if (capturing) {
+		if (ptr == NULL) {
+			if (p != NULL)
+				record_alloc(p, size != 0 ? size : 1);
+		}
+		else if (size == 0) {
+			/* glibc frees ptr */
+			if (p == NULL)
+				record_free(ptr);
+			else
+				record_realloc(ptr, p, 1);
+		}
+		else if (p != NULL)
+			record_realloc(ptr, p, size);
+	}
+	unlock();
+	return p;
+}
+
+EXPORT void* memalign(size_t align, size_t size)
+{
+	void* p = __libc_memalign(align, size);
+
+	if (p != NULL)
+		RECORD(record_alloc(p, size != 0 ? size : 1));
+	return p;
+}
+
+EXPORT void* aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+EXPORT int posix_memalign(void** memptr, size_t align, size_t size)
+{
+	void* p;
+
+	if (align % sizeof(void*) != 0 || (align & (align - 1)) != 0)
+		return EINVAL;
+	if ((p = memalign(align, size)) == NULL)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+EXPORT void* valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void* pvalloc(size_t size)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
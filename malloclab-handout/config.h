@@ -53,15 +53,45 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes (either 4 or 8), or 16 when mm.c is
+ * built with -DALIGNMENT=16
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8  
+#endif
 
 /* 
  * Maximum heap size in bytes 
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
+/*****************************************************************************
+ * Set USE_VM to "1" to back the heap with a range of virtual memory that is
+ * reserved with mmap and committed lazily as the brk advances, instead of a
+ * MAX_HEAP block malloc'd up front. VM_HUGEPAGE asks for huge heap pages:
+ * 0 for none, 1 for transparent huge pages, 2 for explicit (hugetlbfs) ones.
+ * VM_NUMA splits the range into one heap region per NUMA node (up to
+ * VM_MAXNODE), each with a brk of its own: 0 for a single region, 1 for
+ * regions whose pages are placed on first touch, which is by the threads of
+ * the arenas growing there, 2 for regions whose pages are bound to their node.
+ * USE_VM, VM_RESERVE, VM_NUMA and VM_HUGEPAGE may also be given on the command
+ * line (-D), as the libmm.so target of the Makefile does.
+ *****************************************************************************/
+#ifndef USE_VM
+#define USE_VM      0
+#endif
+#ifndef VM_RESERVE
+#define VM_RESERVE  ((size_t)1 << 30)  /* 1 GB of address space */
+#endif
+#ifndef VM_NUMA
+#define VM_NUMA     0
+#endif
+#define VM_MAXNODE  8
+#ifndef VM_HUGEPAGE
+#define VM_HUGEPAGE 0
+#endif
+#define VM_HUGESIZE (2*(1<<20))        /* huge page size in bytes */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
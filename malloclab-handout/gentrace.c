@@ -0,0 +1,451 @@
+/*
+ * gentrace.c - Generate synthetic traces for mdriver from size distributions and
+ *     lifetime models, in phases.
+ *
+ *     usage: gentrace [-S seed] [-o out] phase...
+ *            gentrace [-S seed] -d dir
+ *
+ * Each phase is a list of key=value settings, separated by commas:
+ *
+ *     n=<steps>        requests in the phase (default 100000)
+ *     size=<dist>      fixed:N, uniform:A:B, bimodal:A:B:P (A with probability
+ *                      P, else B) or power:A:B:ALPHA (density x^-ALPHA on A..B);
+ *                      default uniform:8:512
+ *     life=<model>     which live block is freed: lifo (the newest), fifo (the
+ *                      oldest), random, or long (none, until the end)
+ *     live=<blocks>    number of live blocks the phase hovers around (default 1000)
+ *     keep=<f>         fraction of the blocks to keep until the end (default 0)
+ *     realloc=<f>:<g>  fraction of the frees to make reallocs instead, to g times
+ *                      the size (default 0:1.5): g > 1 grows, g < 1 shrinks
+ *     max=<bytes>      largest block a realloc grows to (default 65536)
+ *
+ * The live blocks of a phase carry over into the next one. At the end of the
+ * trace every block is freed, so that the trace is balanced. With the same seed
+ * (-S, default 1) the same trace comes out. The trace goes to out, or the
+ * standard output, in the binary format of tracebin.h if out ends in ".bin",
+ * else as a .rep file. With -d, the standard suite below is written to dir
+ * instead, one .rep file per entry.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "tracebin.h"
+
+#define MAXLINE 1024
+#define MAXPHASES 16
+
+/* The standard suite: name and phases of each trace */
+static struct {
+    char *name;
+    char *phases[MAXPHASES];
+} suite[] = {
+    {"gen-fixed-lifo", {"n=200000,size=fixed:64,life=lifo,live=4000"}},
+    {"gen-fixed-fifo", {"n=200000,size=fixed:64,life=fifo,live=4000"}},
+    {"gen-uniform-random", {"n=200000,size=uniform:8:1024,life=random,live=8000"}},
+    {"gen-power-random", {"n=200000,size=power:16:65536:1.8,life=random,live=4000"}},
+    {"gen-bimodal-fifo", {"n=200000,size=bimodal:32:4096:0.9,life=fifo,live=2000"}},
+    {"gen-long-lived", {"n=200000,size=power:16:8192:1.5,life=random,live=4000,keep=0.1"}},
+    {"gen-realloc-grow", {"n=200000,size=uniform:16:256,life=random,live=1000,"
+			  "realloc=0.4:1.5,max=4096"}},
+    {"gen-realloc-shrink", {"n=200000,size=uniform:1024:8192,life=fifo,live=1000,"
+			    "realloc=0.3:0.7"}},
+    {"gen-phases", {"n=100000,size=fixed:24,life=lifo,live=8000",
+		    "n=100000,size=power:64:65536:1.5,life=random,live=1000",
+		    "n=100000,size=bimodal:16:2048:0.7,life=fifo,live=4000"}},
+};
+
+#define NSUITE (sizeof(suite) / sizeof(suite[0]))
+
+enum { FIXED, UNIFORM, BIMODAL, POWER };
+enum { LIFO, FIFO, RANDOM, LONG };
+
+/* The settings of one phase */
+typedef struct {
+    int n;
+    int dist;
+    double a, b, p;     /* parameters of the size distribution */
+    int life;
+    int live;
+    double keep;
+    double realloc, growth;
+    int max;
+} phase_t;
+
+/* A live block */
+typedef struct {
+    unsigned id;
+    int size;
+} block_t;
+
+/* The live blocks, oldest first, in a ring of cap entries, and the kept ones */
+static block_t *ring, *kept;
+static int head, nlive, cap, nkept, capkept;
+
+static unsigned long long rng;
+static unsigned num_ids, num_ops, last_id;
+static long long live_bytes, peak_bytes;
+static FILE *out;       /* NULL while counting */
+static int binary;
+
+static void fail(char *msg, char *arg)
+{
+    fprintf(stderr, "gentrace: %s: %s\n", msg, arg);
+    exit(1);
+}
+
+/*
+ * uniform - Return a random number in [0, 1), xorshift64*
+ */
+static double uniform(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return ((rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * draw_size - Draw a block size from the distribution of phase ph
+ */
+static int draw_size(phase_t *ph)
+{
+    double u = uniform(), e;
+
+    switch (ph->dist) {
+    case UNIFORM:
+	return (int)(ph->a + u * (ph->b - ph->a + 1));
+    case BIMODAL:
+	return (int)(u < ph->p ? ph->a : ph->b);
+    case POWER:
+	/* Inverse of the distribution function of x^-p on a..b */
+	if (fabs(ph->p - 1) < 1e-9)
+	    return (int)(ph->a * pow(ph->b / ph->a, u));
+	e = 1 - ph->p;
+	return (int)pow(pow(ph->a, e) + u * (pow(ph->b, e) - pow(ph->a, e)), 1 / e);
+    default:
+	return (int)ph->a;
+    }
+}
+
+/*
+ * emit - Write request type of block id with size bytes, or count it
+ */
+static void emit(int type, unsigned id, int size)
+{
+    unsigned char buf[2 * TRACEBIN_MAXVARINT], *p;
+
+    if (out != NULL) {
+	if (binary) {
+	    p = tracebin_put(buf, TRACEBIN_ZIGZAG(id - last_id) << 2 | type);
+	    if (type != TRACEBIN_FREE)
+		p = tracebin_put(p, size);
+	    fwrite(buf, 1, p - buf, out);
+	}
+	else if (type == TRACEBIN_FREE)
+	    fprintf(out, "f %u\n", id);
+	else
+	    fprintf(out, "%c %u %d\n", type == TRACEBIN_ALLOC ? 'a' : 'r', id, size);
+    }
+    last_id = id;
+    num_ops++;
+}
+
+/*
+ * push - Append b to the ring (or the kept blocks, if keep)
+ */
+static void push(block_t b, int keep)
+{
+    block_t *p;
+    int i;
+
+    if (keep) {
+	if (nkept == capkept) {
+	    capkept = capkept ? 2 * capkept : 1024;
+	    if ((kept = realloc(kept, capkept * sizeof(block_t))) == NULL)
+		fail("out of memory", "kept blocks");
+	}
+	kept[nkept++] = b;
+	return;
+    }
+    if (nlive == cap) {
+	if ((p = malloc((cap ? 2 * cap : 1024) * sizeof(block_t))) == NULL)
+	    fail("out of memory", "live blocks");
+	for (i = 0; i < nlive; i++)
+	    p[i] = ring[(head + i) % cap];
+	free(ring);
+	ring = p;
+	head = 0;
+	cap = cap ? 2 * cap : 1024;
+    }
+    ring[(head + nlive++) % cap] = b;
+}
+
+/*
+ * victim - Return the position in the ring of the block that model life
+ *     frees (or reallocs) next
+ */
+static int victim(int life)
+{
+    switch (life) {
+    case LIFO:
+	return nlive - 1;
+    case FIFO:
+	return 0;
+    default:
+	return (int)(uniform() * nlive);
+    }
+}
+
+/*
+ * take - Remove the block at position i of the ring and return it
+ */
+static block_t take(int i)
+{
+    block_t b = ring[(head + i) % cap];
+
+    if (i == 0) {
+	head = (head + 1) % cap;
+    }
+    else if (i != nlive - 1) {
+	/* Random removal: the newest block fills the hole */
+	ring[(head + i) % cap] = ring[(head + nlive - 1) % cap];
+    }
+    nlive--;
+    return b;
+}
+
+/*
+ * run_phase - Make the requests of phase ph
+ */
+static void run_phase(phase_t *ph)
+{
+    block_t b, *bp;
+    int step, i;
+
+    for (step = 0; step < ph->n; step++) {
+	/* Allocate with a probability that falls to 1/2 at live blocks */
+	if (nlive == 0 || ph->life == LONG ||
+	    uniform() < 1 - (double)nlive / (2 * ph->live)) {
+	    b.id = num_ids++;
+	    b.size = draw_size(ph);
+	    if (b.size < 1)
+		b.size = 1;
+	    emit(TRACEBIN_ALLOC, b.id, b.size);
+	    push(b, ph->life == LONG || uniform() < ph->keep);
+	    live_bytes += b.size;
+	}
+	else if (ph->realloc > 0 && uniform() < ph->realloc) {
+	    i = victim(ph->life);
+	    bp = &ring[(head + i) % cap];
+	    b.size = (int)(bp->size * ph->growth);
+	    if (b.size > ph->max)
+		b.size = ph->max;
+	    if (b.size < 1)
+		b.size = 1;
+	    emit(TRACEBIN_REALLOC, bp->id, b.size);
+	    live_bytes += b.size - bp->size;
+	    bp->size = b.size;
+	}
+	else {
+	    b = take(victim(ph->life));
+	    emit(TRACEBIN_FREE, b.id, 0);
+	    live_bytes -= b.size;
+	}
+	if (live_bytes > peak_bytes)
+	    peak_bytes = live_bytes;
+    }
+}
+
+/*
+ * parse_phase - Read the settings of phase ph from spec
+ */
+static void parse_phase(phase_t *ph, char *spec)
+{
+    char buf[MAXLINE], *key, *val, *save = NULL;
+
+    ph->n = 100000;
+    ph->dist = UNIFORM;
+    ph->a = 8;
+    ph->b = 512;
+    ph->p = 0;
+    ph->life = RANDOM;
+    ph->live = 1000;
+    ph->keep = 0;
+    ph->realloc = 0;
+    ph->growth = 1.5;
+    ph->max = 65536;
+
+    if (strlen(spec) >= MAXLINE)
+	fail("phase too long", spec);
+    strcpy(buf, spec);
+    for (key = strtok_r(buf, ",", &save); key != NULL; key = strtok_r(NULL, ",", &save)) {
+	if ((val = strchr(key, '=')) == NULL)
+	    fail("no value in setting", key);
+	*val++ = '\0';
+	if (strcmp(key, "n") == 0)
+	    ph->n = atoi(val);
+	else if (strcmp(key, "size") == 0) {
+	    if (sscanf(val, "fixed:%lf", &ph->a) == 1)
+		ph->dist = FIXED;
+	    else if (sscanf(val, "uniform:%lf:%lf", &ph->a, &ph->b) == 2)
+		ph->dist = UNIFORM;
+	    else if (sscanf(val, "bimodal:%lf:%lf:%lf", &ph->a, &ph->b, &ph->p) == 3)
+		ph->dist = BIMODAL;
+	    else if (sscanf(val, "power:%lf:%lf:%lf", &ph->a, &ph->b, &ph->p) == 3 &&
+		     ph->a > 0 && ph->b >= ph->a)
+		ph->dist = POWER;
+	    else
+		fail("bad size distribution", val);
+	}
+	else if (strcmp(key, "life") == 0) {
+	    if (strcmp(val, "lifo") == 0)
+		ph->life = LIFO;
+	    else if (strcmp(val, "fifo") == 0)
+		ph->life = FIFO;
+	    else if (strcmp(val, "random") == 0)
+		ph->life = RANDOM;
+	    else if (strcmp(val, "long") == 0)
+		ph->life = LONG;
+	    else
+		fail("bad lifetime model", val);
+	}
+	else if (strcmp(key, "live") == 0)
+	    ph->live = atoi(val);
+	else if (strcmp(key, "keep") == 0)
+	    ph->keep = atof(val);
+	else if (strcmp(key, "realloc") == 0) {
+	    if (sscanf(val, "%lf:%lf", &ph->realloc, &ph->growth) < 1)
+		fail("bad realloc setting", val);
+	}
+	else if (strcmp(key, "max") == 0)
+	    ph->max = atoi(val);
+	else
+	    fail("unknown setting", key);
+    }
+    if (ph->n < 0 || ph->live < 1)
+	fail("bad phase", spec);
+}
+
+/*
+ * generate - Make the trace of the nphases phases with seed, and write it
+ *     to out (NULL: only count its requests)
+ */
+static void generate(phase_t *phases, int nphases, unsigned long long seed)
+{
+    block_t b;
+    int i;
+
+    rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+    head = nlive = nkept = 0;
+    num_ids = num_ops = last_id = 0;
+    live_bytes = peak_bytes = 0;
+
+    for (i = 0; i < nphases; i++)
+	run_phase(&phases[i]);
+
+    /* Free what is left, oldest first */
+    while (nlive > 0) {
+	b = take(0);
+	emit(TRACEBIN_FREE, b.id, 0);
+    }
+    for (i = 0; i < nkept; i++)
+	emit(TRACEBIN_FREE, kept[i].id, 0);
+}
+
+/*
+ * write_trace - Write the trace of the phase specs to path (NULL: the
+ *     standard output): count it, then write the header and the requests
+ */
+static void write_trace(char **specs, int nphases, unsigned long long seed, char *path)
+{
+    phase_t phases[MAXPHASES];
+    unsigned char buf[4 * TRACEBIN_MAXVARINT], *p = buf;
+    unsigned header[4];
+    size_t len;
+    int i;
+
+    if (nphases > MAXPHASES)
+	fail("too many phases", specs[MAXPHASES]);
+    for (i = 0; i < nphases; i++)
+	parse_phase(&phases[i], specs[i]);
+
+    out = NULL;
+    generate(phases, nphases, seed);
+    if (num_ids == 0)
+	fail("no block", "allocated");
+
+    len = path != NULL ? strlen(path) : 0;
+    binary = len >= 4 && strcmp(path + len - 4, ".bin") == 0;
+    if (path == NULL)
+	out = stdout;
+    else if ((out = fopen(path, binary ? "wb" : "w")) == NULL)
+	fail("could not create", path);
+
+    /* sugg_heapsize, num_ids, num_ops, weight */
+    header[0] = peak_bytes;
+    header[1] = num_ids;
+    header[2] = num_ops;
+    header[3] = 1;
+    if (binary) {
+	fwrite(TRACEBIN_MAGIC, 1, TRACEBIN_MAGICLEN, out);
+	for (i = 0; i < 4; i++)
+	    p = tracebin_put(p, header[i]);
+	fwrite(buf, 1, p - buf, out);
+    }
+    else
+	fprintf(out, "%u\n%u\n%u\n%u\n", header[0], header[1], header[2], header[3]);
+    generate(phases, nphases, seed);
+    if (fclose(out) != 0)
+	fail("write failed", path != NULL ? path : "standard output");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: gentrace [-S seed] [-o out] phase...\n");
+    fprintf(stderr, "       gentrace [-S seed] -d dir\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *path = NULL, *dir = NULL;
+    char name[MAXLINE];
+    unsigned long long seed = 1;
+    unsigned i;
+    int c, n;
+
+    while ((c = getopt(argc, argv, "S:o:d:")) != EOF)
+	switch (c) {
+	case 'S':
+	    seed = strtoull(optarg, NULL, 0);
+	    break;
+	case 'o':
+	    path = optarg;
+	    break;
+	case 'd':
+	    dir = optarg;
+	    break;
+	default:
+	    usage();
+	}
+
+    if (dir != NULL) {
+	if (optind != argc)
+	    usage();
+	for (i = 0; i < NSUITE; i++) {
+	    for (n = 0; n < MAXPHASES && suite[i].phases[n] != NULL; n++)
+		;
+	    if (snprintf(name, MAXLINE, "%s/%s.rep", dir, suite[i].name) >= MAXLINE)
+		fail("directory name too long", dir);
+	    write_trace(suite[i].phases, n, seed, name);
+	}
+	return 0;
+    }
+    if (optind == argc)
+	usage();
+    write_trace(argv + optind, argc - optind, seed, path);
+    return 0;
+}
@@ -13,13 +13,22 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
+#include "perfctr.h"
+#include "bench.h"
 #include "config.h"
+#include "tracebin.h"
 
 /**********************
  * Constants and macros
@@ -31,19 +40,43 @@
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
+
+/* Latency histograms: 2^LAT_SUB buckets per power of two cycles */
+#define LAT_SUB        3
+#define LAT_BUCKETS    (64 << LAT_SUB)
+#define NUM_OPTYPES    3 /* one histogram per request type */
+
+/* Number of runs of a trace with the event counters on */
+#define PERF_RUNS     10
+
+/* Multi-threaded replay: runs per thread count (the fastest counts), and */
+/* capacity of the queue passing blocks to the next thread for freeing */
+#define MT_RUNS        5
+#define MT_QUEUE    4096
+
+/* Max number of worker processes evaluating the traces at once (-j) */
+#define MAX_JOBS      64
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload, as a node of a treap
+ * ordered by address. Live payloads never overlap, so their order
+ * by lo is their order by hi as well.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below lo */
+    struct range_t *right; /* ranges above hi */
 } range_t;
 
+/* Heap priority of a range in the treap: a hash of its record address */
+#define RANGE_PRIO(p) ((unsigned int)(unsigned long)(p) * 2654435761u)
+
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
     enum {ALLOC, FREE, REALLOC} type; /* type of request */
@@ -57,11 +90,26 @@ typedef struct {
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    traceop_t *ops;      /* array of requests, or NULL for a binary trace... */
+    unsigned char *map;  /* ... mapped here, see tracebin.h */
+    size_t map_size;     /* byte size of the mapping */
+    const unsigned char *map_ops;  /* first request in the mapping */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
 
+/* 
+ * Reads the requests of a trace in order, from its array or decoding
+ * them from its mapping one at a time (first_op and next_op).
+ */
+typedef struct {
+    trace_t *trace;
+    int i;                    /* next request of the array */
+    const unsigned char *pos; /* next request of the mapping... */
+    int index;                /* ... the index of the one before */
+    traceop_t op;             /* ... and the last one decoded */
+} opcursor_t;
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -72,6 +120,27 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* One thread of a multi-threaded replay */
+typedef struct replay_t {
+    trace_t *trace;      /* trace to replay, shared by the threads */
+    int shard, nshards;  /* replays the block ids equal to shard mod nshards */
+    char **blocks;       /* the blocks of this thread, by id */
+    struct replay_t *next;  /* thread that frees this one's blocks, or NULL */
+    void *queue[MT_QUEUE];  /* blocks from the previous thread, to free */
+    unsigned head, tail; /* queue positions: taken, added */
+    pthread_barrier_t *barrier;  /* start and end of the replay */
+    int failed;          /* set if the heap ran out */
+    double ops;          /* number of requests made */
+    double start, end;   /* clock at the first and after the last of them */
+} replay_t;
+
+/* Log-bucketed histogram of the latencies of one request type, in cycles */
+typedef struct {
+    unsigned long count;                /* number of requests */
+    double max;                         /* latency of the slowest one */
+    unsigned long bucket[LAT_BUCKETS];  /* number of requests by bucket */
+} lathist_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +150,9 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    lathist_t lat[NUM_OPTYPES]; /* request latencies, by type (with -L) */
+    double events[PERFCTR_NUM]; /* event counts per run, -1 if not counted (-P) */
+    bench_t warm, cold;         /* timed trials with warm and cold caches (-B) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -95,6 +167,9 @@ char msg[MAXLINE];      /* for whenever we need to compose an error message */
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Request type names, in the order of traceop_t */
+static char *optype_names[NUM_OPTYPES] = {"malloc", "free", "realloc"};
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {  
     DEFAULT_TRACEFILES, NULL
@@ -105,15 +180,18 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range treaps */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
+static int map_trace(trace_t *trace, FILE *tracefile, char *path);
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
+static void first_op(trace_t *trace, opcursor_t *c);
+static traceop_t *next_op(opcursor_t *c);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -124,9 +202,25 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, lathist_t *lat);
+static void eval_mm_scaling(trace_t *trace, int maxthreads, int shards, int cross);
+static void eval_mm_heapstats(trace_t *trace, char *name);
+static void eval_mm_trace(int tracenum, char *file, stats_t *stats,
+			  range_t **ranges, int latency, int perfcount,
+			  int trials, int heapstats);
+static void eval_mm_parallel(char **tracefiles, int n, stats_t *stats,
+			     int maxjobs, int latency, int perfcount,
+			     int trials, int heapstats);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printnuma(void);
+static void printlatency(int n, stats_t *stats);
+static void printevents(int n, stats_t *stats);
+static void printheapstats(heapstats_t *hs, int n);
+static void printbench(int n, stats_t *stats);
+static void writeresults(char *path, char **tracefiles, int n, stats_t *stats,
+			 double perfindex, int trials, int cpu);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -146,10 +240,20 @@ int main(int argc, char **argv)
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    int jobs = 0;              /* If set, evaluate this many traces at once (-j) */
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int latency = 0;     /* If set, measure request latencies (set by -L) */
+    int perfcount = 0;   /* If set, count hardware events (set by -P) */
+    int threads = 0;     /* If set, replay on up to this many threads (-T) */
+    int shards = 0;      /* If set, threads replay shards of a trace (-s) */
+    int cross = 0;       /* If set, threads free each other's blocks (-x) */
+    int heapstats = 0;   /* If set, print heap statistics (set by -H) */
+    int trials = 0;      /* If set, time this many trials per trace (-B) */
+    int cpu = -1;        /* If set, pin the driver to this CPU (-c) */
+    char *outfile = NULL;/* If set, write the results as JSON or CSV (-o) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,21 +262,21 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalLPT:sxHB:c:o:j:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
-        case 'f': /* Use one specific trace file only (relative to curr dir) */
-            num_tracefiles = 1;
-            if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
+        case 'f': /* Use specific trace files only (relative to curr dir) */
+            num_tracefiles++;
+            if ((tracefiles = realloc(tracefiles, (num_tracefiles+1)*sizeof(char *))) == NULL)
 		unix_error("ERROR: realloc failed in main");
 	    strcpy(tracedir, "./"); 
-            tracefiles[0] = strdup(optarg);
-            tracefiles[1] = NULL;
+            tracefiles[num_tracefiles-1] = strdup(optarg);
+            tracefiles[num_tracefiles] = NULL;
             break;
 	case 't': /* Directory where the traces are located */
-	    if (num_tracefiles == 1) /* ignore if -f already encountered */
+	    if (num_tracefiles > 0) /* ignore if -f already encountered */
 		break;
 	    strcpy(tracedir, optarg);
 	    if (tracedir[strlen(tracedir)-1] != '/') 
@@ -184,6 +288,54 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'L': /* Measure the latency of each mm request */
+            latency = 1;
+            break;
+        case 'P': /* Count the hardware events of the mm requests */
+            perfcount = 1;
+            break;
+        case 'T': /* Replay each trace on 1, 2, 4, ... threads at once */
+            if ((threads = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 's': /* Split each trace among the threads */
+            shards = 1;
+            break;
+        case 'x': /* Pass blocks to another thread to free */
+            cross = 1;
+            break;
+        case 'H': /* Print heap statistics of each trace */
+            heapstats = 1;
+            break;
+        case 'B': /* Time the traces in warm and cold trials */
+            if ((trials = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'c': /* Pin the driver to a CPU */
+            if ((cpu = atoi(optarg)) < 0 || bench_pin(cpu) < 0) {
+		printf("ERROR: could not pin to CPU %s\n", optarg);
+		exit(1);
+	    }
+            break;
+        case 'j': /* Evaluate the traces in parallel worker processes */
+            if ((jobs = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'o': /* Write the results to a JSON or CSV file */
+            outfile = optarg;
+	    if (strlen(outfile) < 5 ||
+		(strcmp(outfile + strlen(outfile) - 5, ".json") != 0 &&
+		 strcmp(outfile + strlen(outfile) - 4, ".csv") != 0)) {
+		printf("ERROR: output file %s is neither .json nor .csv\n", outfile);
+		exit(1);
+	    }
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -284,28 +436,22 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
     
+    /* Open the event counters */
+    if (perfcount && perfctr_init() == 0)
+	printf("No hardware event counters available (perf_event_open)\n");
+
+    /* Evaluate the traces in worker processes, with a heap each (-j) */
+    if (jobs > 0)
+	eval_mm_parallel(tracefiles, num_tracefiles, mm_stats, jobs,
+			 latency, perfcount, trials, heapstats);
+
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    for (i=0; jobs == 0 && i < num_tracefiles; i++)
+	eval_mm_trace(i, tracefiles[i], &mm_stats[i], &ranges,
+		      latency, perfcount, trials, heapstats);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -313,6 +459,36 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (trials > 0) {
+	printf("\nTrials of mm malloc (%d per trace, %s):\n", trials,
+	       cpu >= 0 ? "pinned" : "not pinned");
+	printbench(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (latency) {
+	printf("\nRequest latencies for mm malloc (cycles):\n");
+	printlatency(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (perfcount) {
+	printf("\nHardware events per request for mm malloc:\n");
+	printevents(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+
+    /* Replay the valid traces on several threads at once */
+    for (i = 0; threads > 0 && i < num_tracefiles; i++) {
+	if (!mm_stats[i].valid)
+	    continue;
+	trace = read_trace(tracedir, tracefiles[i]);
+	printf("\nScaling of mm malloc on %s (%s%s):\n", tracefiles[i],
+	       shards ? "one shard per thread" : "one copy per thread",
+	       cross ? ", cross-thread frees" : "");
+	eval_mm_scaling(trace, threads, shards, cross);
+	free_trace(trace);
+    }
+    if (threads > 0)
+	printf("\n");
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -361,22 +537,66 @@ int main(int argc, char **argv)
 	printf("correct:%d\n", numcorrect);
 	printf("perfidx:%.0f\n", perfindex);
     }
+    if (outfile != NULL)
+	writeresults(outfile, tracefiles, num_tracefiles, mm_stats,
+		     perfindex, trials, cpu);
 
     exit(0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range treap, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range treap to detect any overlapping allocated blocks, in time
+ * logarithmic in the number of live blocks.
  ****************************************************************/
 
+/*
+ * find_range - Return a range of the treap overlapping lo:hi, or NULL
+ */
+static range_t *find_range(range_t *p, char *lo, char *hi)
+{
+    while (p != NULL && (hi < p->lo || lo > p->hi))
+	p = hi < p->lo ? p->left : p->right;
+    return p;
+}
+
+/*
+ * insert_range - Insert range q, which overlaps none of them, into the
+ *     treap at *pp, rotating it up while it outranks its parent
+ */
+static void insert_range(range_t **pp, range_t *q)
+{
+    range_t *p = *pp;
+
+    if (p == NULL) {
+	q->left = q->right = NULL;
+	*pp = q;
+    }
+    else if (q->lo < p->lo) {
+	insert_range(&p->left, q);
+	if (RANGE_PRIO(p->left) > RANGE_PRIO(p)) {
+	    *pp = p->left;
+	    p->left = (*pp)->right;
+	    (*pp)->right = p;
+	}
+    }
+    else {
+	insert_range(&p->right, q);
+	if (RANGE_PRIO(p->right) > RANGE_PRIO(p)) {
+	    *pp = p->right;
+	    p->right = (*pp)->left;
+	    (*pp)->left = p;
+	}
+    }
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range treap. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
@@ -395,9 +615,10 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or a mapped region */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -405,26 +626,22 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    if ((p = find_range(*ranges, lo, hi)) != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range treap.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    insert_range(ranges, p);
     return 1;
 }
 
@@ -433,19 +650,35 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    range_t *p, *q;
+    range_t **pp = ranges;
+
+    /* Search the link to the range */
+    while ((p = *pp) != NULL && p->lo != lo)
+	pp = lo < p->lo ? &p->left : &p->right;
+    if (p == NULL)
+	return;
+
+    /* Rotate the child with higher priority up until the range is a leaf */
+    while (p->left != NULL || p->right != NULL) {
+	if (p->right == NULL || 
+	    (p->left != NULL && RANGE_PRIO(p->left) > RANGE_PRIO(p->right))) {
+	    q = p->left;
+	    p->left = q->right;
+	    q->right = p;
+	    *pp = q;
+	    pp = &q->right;
+	}
+	else {
+	    q = p->right;
+	    p->right = q->left;
+	    q->left = p;
+	    *pp = q;
+	    pp = &q->left;
+	}
     }
+    *pp = NULL;
+    free(p);
 }
 
 /*
@@ -453,14 +686,14 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_t *p = *ranges;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (p != NULL) {
+	clear_ranges(&p->left);
+	clear_ranges(&p->right);
+	free(p);
+	*ranges = NULL;
     }
-    *ranges = NULL;
 }
 
 
@@ -469,7 +702,68 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * map_trace - Map the binary trace open as tracefile, and check that every
+ *     request of it decodes, so that next_op can read them without checks.
+ *     Return 0 if it is not a binary trace.
+ */
+static int map_trace(trace_t *trace, FILE *tracefile, char *path)
+{
+    char magic[TRACEBIN_MAGICLEN];
+    struct stat st;
+    const unsigned char *pos, *end;
+    unsigned header[4], tag, size;
+    unsigned max_index = 0;
+    int i, index;
+
+    if (fread(magic, 1, TRACEBIN_MAGICLEN, tracefile) != TRACEBIN_MAGICLEN ||
+	memcmp(magic, TRACEBIN_MAGIC, TRACEBIN_MAGICLEN) != 0)
+	return 0;
+    if (fstat(fileno(tracefile), &st) < 0)
+	unix_error("fstat failed in map_trace");
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE, 
+		      fileno(tracefile), 0);
+    if (trace->map == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    madvise(trace->map, trace->map_size, MADV_SEQUENTIAL);
+    pos = trace->map + TRACEBIN_MAGICLEN;
+    end = trace->map + trace->map_size;
+
+    /* Read the trace file header */
+    for (i = 0; i < 4; i++)
+	if ((pos = tracebin_get(pos, end, &header[i])) == NULL || 
+	    header[i] > INT_MAX) {
+	    sprintf(msg, "Bad header in binary trace %s", path);
+	    app_error(msg);
+	}
+    trace->sugg_heapsize = header[0]; /* not used */
+    trace->num_ids = header[1];
+    trace->num_ops = header[2];
+    trace->weight = header[3];        /* not used */
+    trace->map_ops = pos;
+
+    /* Check every request */
+    index = 0;
+    for (i = 0; i < trace->num_ops; i++) {
+	if ((pos = tracebin_get(pos, end, &tag)) == NULL ||
+	    (tag & 3) > TRACEBIN_REALLOC ||
+	    (unsigned)(index += TRACEBIN_UNZIGZAG(tag >> 2)) >= (unsigned)trace->num_ids ||
+	    ((tag & 3) != TRACEBIN_FREE && 
+	     (pos = tracebin_get(pos, end, &size)) == NULL))
+	    break;
+	max_index = ((unsigned)index > max_index) ? (unsigned)index : max_index;
+    }
+    if (i < trace->num_ops || pos != end) {
+	sprintf(msg, "Bad request %d in binary trace %s", i, path);
+	app_error(msg);
+    }
+    assert(max_index == trace->num_ids - 1);
+    return 1;
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. A binary trace
+ *     is mapped instead, and its requests are decoded as they are replayed.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
@@ -487,6 +781,8 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
+    trace->ops = NULL;
+    trace->map = NULL;
 	
     /* Read the trace file header */
     strcpy(path, tracedir);
@@ -495,15 +791,18 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    if (!map_trace(trace, tracefile, path)) {
+	rewind(tracefile);
+	fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
+	fscanf(tracefile, "%d", &(trace->num_ids));     
+	fscanf(tracefile, "%d", &(trace->num_ops));     
+	fscanf(tracefile, "%d", &(trace->weight));        /* not used */
     
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
+	/* We'll store each request line in the trace in this array */
+	if ((trace->ops = 
+	     (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+	    unix_error("malloc 2 failed in read_trace");
+    }
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -514,6 +813,10 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace->block_sizes = 
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
+    if (trace->map != NULL) {
+	fclose(tracefile);
+	return trace;
+    }
     
     /* read every request line in the trace file */
     index = 0;
@@ -556,16 +859,54 @@ static trace_t *read_trace(char *tracedir, char *filename)
 
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), or
+ *              unmap the requests of a binary trace.
  */
 void free_trace(trace_t *trace)
 {
+    if (trace->map != NULL)
+	munmap(trace->map, trace->map_size);
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * first_op - Set up cursor c to read the requests of trace from the first
+ */
+static void first_op(trace_t *trace, opcursor_t *c)
+{
+    c->trace = trace;
+    c->i = 0;
+    c->pos = trace->map_ops;
+    c->index = 0;
+}
+
+/*
+ * next_op - Return the next request of cursor c. The caller counts them:
+ *     there is none past the num_ops of the trace.
+ */
+static traceop_t *next_op(opcursor_t *c)
+{
+    unsigned tag = 0, size = 0;
+
+    if (c->trace->ops != NULL)
+	return &c->trace->ops[c->i++];
+
+    /* Checked by map_trace, so no bound */
+    c->pos = tracebin_get(c->pos, NULL, &tag);
+    c->index += TRACEBIN_UNZIGZAG(tag >> 2);
+    c->op.type = tag & 3;
+    c->op.index = c->index;
+    c->op.size = 0;
+    if (c->op.type != FREE) {
+	c->pos = tracebin_get(c->pos, NULL, &size);
+	c->op.size = size;
+    }
+    return &c->op;
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -577,6 +918,8 @@ void free_trace(trace_t *trace)
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
     int i, j;
+    opcursor_t cur;
+    traceop_t *op;
     int index;
     int size;
     int oldsize;
@@ -584,7 +927,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range treap */
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -595,11 +938,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    for (first_op(trace, &cur), i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+	index = op->index;
+	size = op->size;
 
-        switch (trace->ops[i].type) {
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -611,7 +955,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range treap if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -638,10 +982,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range treap */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range treap */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -653,7 +997,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -689,15 +1033,17 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   high water mark of the heap plus the mapped regions while running
+ *   the student's malloc package on the trace. Since mem_sbrk() allows
+ *   the brk pointer to be decremented and mapped regions come and go,
+ *   the final heap size is not the peak, so memlib keeps track of it.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 {   
     int i;
+    opcursor_t cur;
+    traceop_t *op;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
@@ -710,12 +1056,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (first_op(trace, &cur), i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+        switch (op->type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 
 	    if ((p = mm_malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
@@ -734,8 +1081,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op->index;
+	    newsize = op->size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
@@ -756,7 +1103,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
@@ -774,7 +1121,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
@@ -785,6 +1132,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 static void eval_mm_speed(void *ptr)
 {
     int i, index, size, newsize;
+    opcursor_t cur;
+    traceop_t *op;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -794,20 +1143,21 @@ static void eval_mm_speed(void *ptr)
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (first_op(trace, &cur), i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
+	    index = op->index;
+            newsize = op->size;
 	    oldp = trace->blocks[index];
             if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
@@ -815,7 +1165,7 @@ static void eval_mm_speed(void *ptr)
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             block = trace->blocks[index];
             mm_free(block);
             break;
@@ -823,6 +1173,314 @@ static void eval_mm_speed(void *ptr)
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+    }
+}
+
+/*
+ * lat_bucket - Return the latency histogram bucket of a request that took
+ *     cycles: exact below 2^LAT_SUB, then 2^LAT_SUB per power of two
+ */
+static int lat_bucket(double cycles)
+{
+    unsigned long long v = cycles < 1 ? 0 : (unsigned long long)cycles;
+    int log;
+
+    if (v < (1ULL << LAT_SUB))
+	return (int)v;
+    log = 63 - __builtin_clzll(v);
+    return ((log - LAT_SUB + 1) << LAT_SUB) | 
+	(int)((v >> (log - LAT_SUB)) & ((1 << LAT_SUB) - 1));
+}
+
+/*
+ * lat_bound - Return the largest latency that falls in bucket b
+ */
+static double lat_bound(int b)
+{
+    int e = b >> LAT_SUB, m = b & ((1 << LAT_SUB) - 1);
+
+    if (e == 0)
+	return m;
+    return (double)(((((1ULL << LAT_SUB) + m + 1)) << (e - 1)) - 1);
+}
+
+/*
+ * lat_percentile - Return the latency that a fraction q of the requests
+ *     counted in h do not exceed, to the bucket bound
+ */
+static double lat_percentile(lathist_t *h, double q)
+{
+    unsigned long need = (unsigned long)(q * h->count), seen = 0;
+    int b;
+
+    if (need < q * h->count || need == 0)
+	need++;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	seen += h->bucket[b];
+	if (seen >= need)
+	    return lat_bound(b) < h->max ? lat_bound(b) : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * eval_mm_latency - Run the trace once more, reading the cycle counter
+ *     around every request, and count the latencies in the histograms
+ *     of lat, one per request type. The cost of reading the counter is
+ *     taken off.
+ */
+static void eval_mm_latency(trace_t *trace, lathist_t *lat)
+{
+    int i, index, size, newsize;
+    opcursor_t cur;
+    traceop_t *op;
+    char *p, *newp, *oldp, *block;
+    double start, cycles, overhead = DBL_MAX;
+    lathist_t *h;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+
+    /* The counter overhead is the shortest of a few back-to-back reads */
+    start_counter();
+    for (i = 0; i < 100; i++) {
+	start = get_counter();
+	if ((cycles = get_counter() - start) < overhead)
+	    overhead = cycles;
+    }
+
+    /* Interpret and time each trace request */
+    for (first_op(trace, &cur), i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+	start = get_counter();
+        switch (op->type) {
+
+        case ALLOC: /* mm_malloc */
+            index = op->index;
+            size = op->size;
+            if ((p = mm_malloc(size)) == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+	    index = op->index;
+            newsize = op->size;
+	    oldp = trace->blocks[index];
+            if ((newp = mm_realloc(oldp,newsize)) == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = newp;
+            break;
+
+        case FREE: /* mm_free */
+            index = op->index;
+            block = trace->blocks[index];
+            mm_free(block);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+        }
+	cycles = get_counter() - start - overhead;
+
+	h = &lat[op->type];
+	h->count++;
+	h->bucket[lat_bucket(cycles)]++;
+	if (cycles > h->max)
+	    h->max = cycles;
+    }
+}
+
+/*
+ * replay_free - Free bp on behalf of thread r: hand it to the next thread
+ *     if there is one and its queue has room, else free it here
+ */
+static void replay_free(replay_t *r, void *bp)
+{
+    replay_t *q = r->next;
+    unsigned tail;
+
+    if (q != NULL) {
+	tail = q->tail;
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) < MT_QUEUE) {
+	    q->queue[tail % MT_QUEUE] = bp;
+	    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	    return;
+	}
+    }
+    mm_free(bp);
+}
+
+/*
+ * replay_drain - Free the blocks the previous thread has queued for r
+ */
+static void replay_drain(replay_t *r)
+{
+    unsigned head = r->head, tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+	return;
+    for (; head != tail; head++)
+	mm_free(r->queue[head % MT_QUEUE]);
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * replay_thread - Replay the shard of the trace of one thread after the
+ *     start barrier, and free what the other threads pass once they are
+ *     all done
+ */
+static void *replay_thread(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    trace_t *trace = r->trace;
+    struct timespec ts;
+    int i, index;
+    opcursor_t cur;
+    traceop_t *op;
+    char *p = NULL;
+
+    pthread_barrier_wait(r->barrier);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->start = ts.tv_sec + ts.tv_nsec / 1e9;
+    for (first_op(trace, &cur), i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+	index = op->index;
+	if (index % r->nshards != r->shard)
+	    continue;
+        switch (op->type) {
+
+        case ALLOC: /* mm_malloc */
+            p = mm_malloc(op->size);
+            r->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            p = mm_realloc(r->blocks[index], op->size);
+            r->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            replay_free(r, r->blocks[index]);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_scaling");
+        }
+	if (op->type != FREE && p == NULL) {
+	    r->failed = 1;
+	    break;
+	}
+	r->ops++;
+	replay_drain(r);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->end = ts.tv_sec + ts.tv_nsec / 1e9;
+
+    /* No block is queued once every replay is done */
+    pthread_barrier_wait(r->barrier);
+    replay_drain(r);
+    return NULL;
+}
+
+/*
+ * eval_mm_scaling - Replay the trace on 1, 2, 4, ... up to maxthreads
+ *     threads at once, against one heap, and print the aggregate and
+ *     per-thread throughput of the fastest of MT_RUNS runs for each count.
+ *     Every thread replays a copy of the trace, or with shards the block
+ *     ids equal to its number modulo the thread count. With cross, each
+ *     thread frees the blocks of the previous one.
+ */
+static void eval_mm_scaling(trace_t *trace, int maxthreads, int shards, int cross)
+{
+    replay_t *r;
+    pthread_t *tids;
+    pthread_barrier_t barrier;
+    double start, end, best, ops, minthru, thru, base = 0;
+    int n, i, run;
+
+    if ((r = (replay_t *)calloc(maxthreads, sizeof(replay_t))) == NULL ||
+	(tids = (pthread_t *)malloc(maxthreads * sizeof(pthread_t))) == NULL)
+	unix_error("malloc failed in eval_mm_scaling");
+    for (i = 0; i < maxthreads; i++)
+	if ((r[i].blocks = (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+	    unix_error("malloc failed in eval_mm_scaling");
+
+    printf("%7s%10s%10s%10s%12s%12s%8s\n", 
+	   "threads", "ops", "secs", "Kops", "Kops/thread", "min/thread", "speedup");
+    for (n = 1; n <= maxthreads; n = (n == maxthreads || 2 * n < maxthreads) ? 2 * n : maxthreads) {
+	best = DBL_MAX;
+	ops = minthru = 0;
+	for (run = 0; run < MT_RUNS; run++) {
+	    /* Reset the heap and initialize the mm package */
+	    mem_reset_brk();
+	    if (mm_init() < 0) 
+		app_error("mm_init failed in eval_mm_scaling");
+
+	    pthread_barrier_init(&barrier, NULL, n + 1);
+	    for (i = 0; i < n; i++) {
+		r[i].trace = trace;
+		r[i].shard = shards ? i : 0;
+		r[i].nshards = shards ? n : 1;
+		r[i].next = cross && n > 1 ? &r[(i + 1) % n] : NULL;
+		r[i].head = r[i].tail = 0;
+		r[i].barrier = &barrier;
+		r[i].failed = 0;
+		r[i].ops = 0;
+		if (pthread_create(&tids[i], NULL, replay_thread, &r[i]) != 0)
+		    unix_error("pthread_create failed in eval_mm_scaling");
+	    }
+
+	    /* Release the threads, and wait for all the replays to end */
+	    pthread_barrier_wait(&barrier);
+	    pthread_barrier_wait(&barrier);
+	    for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	    pthread_barrier_destroy(&barrier);
+	    for (i = 0; i < n && !r[i].failed; i++)
+		;
+	    if (i < n)
+		break;
+
+	    /* Time from the first thread to start to the last one to end */
+	    start = r[0].start;
+	    end = r[0].end;
+	    for (i = 1; i < n; i++) {
+		if (r[i].start < start)
+		    start = r[i].start;
+		if (r[i].end > end)
+		    end = r[i].end;
+	    }
+	    if (end - start < best) {
+		best = end - start;
+		ops = minthru = 0;
+		for (i = 0; i < n; i++) {
+		    ops += r[i].ops;
+		    thru = r[i].end > r[i].start ? r[i].ops / (r[i].end - r[i].start) : 0;
+		    if (i == 0 || thru < minthru)
+			minthru = thru;
+		}
+	    }
+	}
+	if (run < MT_RUNS) {
+	    printf("%7d  ran out of heap memory\n", n);
+	    break;
+	}
+	if (n == 1)
+	    base = ops / best;
+	printf("%7d%10.0f%10.6f%10.0f%12.0f%12.0f%8.2f\n",
+	       n, ops, best, ops / best / 1e3, ops / best / 1e3 / n, 
+	       minthru / 1e3, ops / best / base);
+	if (n == maxthreads)
+	    break;
+    }
+
+    for (i = 0; i < maxthreads; i++)
+	free(r[i].blocks);
+    free(r);
+    free(tids);
 }
 
 /*
@@ -834,31 +1492,34 @@ static void eval_mm_speed(void *ptr)
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
     int i, newsize;
+    opcursor_t cur;
+    traceop_t *op;
     char *p, *newp, *oldp;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (first_op(trace, &cur), i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+        switch (op->type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op->size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op->index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op->size;
+	    oldp = trace->blocks[op->index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op->index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op->index]);
 	    break;
 
 	default:
@@ -877,23 +1538,26 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 static void eval_libc_speed(void *ptr)
 {
     int i;
+    opcursor_t cur;
+    traceop_t *op;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (first_op(trace, &cur), i = 0;  i < trace->num_ops;  i++) {
+	op = next_op(&cur);
+        switch (op->type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op->index;
+	    newsize = op->size;
 	    oldp = trace->blocks[index];
 	    if ((newp = realloc(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
@@ -902,7 +1566,7 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
@@ -915,6 +1579,503 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * eval_mm_heapstats - Replay the trace once more and print the heap
+ *     statistics of the mm package at the peak of the live payload and
+ *     at the end of the trace
+ */
+static void eval_mm_heapstats(trace_t *trace, char *name)
+{
+    int i, index, peak = -1;
+    long total = 0, max_total = 0;
+    opcursor_t cur;
+    traceop_t *op;
+    heapstats_t hs[2];
+    char *p;
+
+    /* Find the request after which the live payload peaks */
+    for (first_op(trace, &cur), i = 0; i < trace->num_ops; i++) {
+	op = next_op(&cur);
+	if (op->type == FREE)
+	    total -= trace->block_sizes[op->index];
+	else {
+	    if (op->type == REALLOC)
+		total -= trace->block_sizes[op->index];
+	    total += op->size;
+	    trace->block_sizes[op->index] = op->size;
+	}
+	if (total > max_total) {
+	    max_total = total;
+	    peak = i;
+	}
+    }
+
+    /* Replay it up to the peak, then to the end */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_heapstats");
+    mm_heapstats(&hs[0]);
+    for (first_op(trace, &cur), i = 0; i < trace->num_ops; i++) {
+	op = next_op(&cur);
+	index = op->index;
+	switch (op->type) {
+
+	case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(op->size)) == NULL)
+		app_error("mm_malloc failed in eval_mm_heapstats");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(trace->blocks[index], op->size)) == NULL)
+		app_error("mm_realloc failed in eval_mm_heapstats");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* mm_free */
+	    mm_free(trace->blocks[index]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_heapstats");
+	}
+	if (i == peak)
+	    mm_heapstats(&hs[0]);
+    }
+    mm_heapstats(&hs[1]);
+
+    printf("\nHeap statistics of mm malloc on %s (peak at request %d):\n",
+	   name, peak + 1);
+    printheapstats(hs, 2);
+}
+
+/*
+ * eval_mm_trace - Evaluate the mm package on trace tracenum, read from
+ *     file: check it for correctness, then measure its utilization and
+ *     throughput and whatever else the flags ask for, into *stats
+ */
+static void eval_mm_trace(int tracenum, char *file, stats_t *stats,
+			  range_t **ranges, int latency, int perfcount,
+			  int trials, int heapstats)
+{
+    trace_t *trace;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, file);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, ranges);
+	speed_params.trace = trace;
+	speed_params.ranges = *ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	if (trials > 0) {
+	    bench_run(eval_mm_speed, &speed_params, trials, 1, &stats->warm);
+	    bench_run(eval_mm_speed, &speed_params, trials, 0, &stats->cold);
+	    stats->secs = stats->warm.mean;
+	}
+	else
+	    stats->secs = fsecs(eval_mm_speed, &speed_params);
+	if (latency)
+	    eval_mm_latency(trace, stats->lat);
+	if (perfcount)
+	    perfctr_run(eval_mm_speed, &speed_params, PERF_RUNS, stats->events);
+	if (verbose > 1 && mem_numa_nodes() > 1)
+	    printnuma();
+	if (heapstats)
+	    eval_mm_heapstats(trace, file);
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_parallel - Evaluate the n traces like eval_mm_trace, each in a
+ *     worker process of its own with its own simulated heap, and at most
+ *     maxjobs of them at once. Each worker is pinned to a CPU of its own
+ *     among those the driver may run on, which also caps the number of
+ *     workers, so that they do not time each other. The results come back
+ *     in shared memory, and the output of each worker is printed in one
+ *     piece once it is done. A worker that fails leaves its trace invalid.
+ */
+static void eval_mm_parallel(char **tracefiles, int n, stats_t *stats,
+			     int maxjobs, int latency, int perfcount,
+			     int trials, int heapstats)
+{
+    int cpus[MAX_JOBS];
+    pid_t pids[MAX_JOBS];
+    int slot_trace[MAX_JOBS];
+    FILE *out[MAX_JOBS];
+    range_t *ranges = NULL;
+    stats_t *shared;
+    int *errs;
+    int ncpus, jobs, next, running, s, t, status, c;
+    pid_t pid;
+
+    /* One worker per CPU at most, unpinned where the CPUs are unknown */
+    ncpus = bench_cpus(cpus, MAX_JOBS);
+    jobs = ncpus > 0 ? ncpus : MAX_JOBS;
+    if (maxjobs < jobs)
+	jobs = maxjobs;
+
+    shared = mmap(NULL, n * (sizeof(stats_t) + sizeof(int)), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+	unix_error("mmap failed in eval_mm_parallel");
+    errs = (int *)(shared + n);
+    for (s = 0; s < jobs; s++)
+	pids[s] = 0;
+
+    if (verbose)
+	printf("Evaluating %d traces in up to %d worker%s%s\n", n, jobs,
+	       jobs > 1 ? "s" : "", ncpus > 0 ? ", one CPU each" : "");
+    fflush(stdout);
+    for (next = running = 0; next < n || running > 0; ) {
+	/* Start the next trace in a free slot */
+	if (next < n && running < jobs) {
+	    for (s = 0; pids[s] != 0; s++)
+		;
+	    if ((out[s] = tmpfile()) == NULL)
+		unix_error("tmpfile failed in eval_mm_parallel");
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_mm_parallel");
+	    if (pid == 0) {
+		if (dup2(fileno(out[s]), STDOUT_FILENO) < 0)
+		    unix_error("dup2 failed in eval_mm_parallel");
+		if (ncpus > 0)
+		    bench_pin(cpus[s]);
+		if (perfcount)
+		    perfctr_init();
+		errors = 0;
+		mem_init();
+		memset(&shared[next], 0, sizeof(stats_t));
+		eval_mm_trace(next, tracefiles[next], &shared[next], &ranges,
+			      latency, perfcount, trials, heapstats);
+		errs[next] = errors;
+		exit(0);
+	    }
+	    pids[s] = pid;
+	    slot_trace[s] = next++;
+	    running++;
+	    continue;
+	}
+
+	/* Collect the worker that finishes first */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait failed in eval_mm_parallel");
+	for (s = 0; s < jobs && pids[s] != pid; s++)
+	    ;
+	if (s == jobs)
+	    continue;
+	t = slot_trace[s];
+	rewind(out[s]);
+	while ((c = getc(out[s])) != EOF)
+	    putchar(c);
+	fclose(out[s]);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    shared[t].valid = 0;
+	    errs[t] = 1;
+	    printf("ERROR [trace %d]: worker %s %d\n", t,
+		   WIFEXITED(status) ? "exited with status" : "killed by signal",
+		   WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+	}
+	fflush(stdout);
+	pids[s] = 0;
+	running--;
+    }
+
+    for (t = 0; t < n; t++) {
+	stats[t] = shared[t];
+	errors += errs[t];
+    }
+    munmap(shared, n * (sizeof(stats_t) + sizeof(int)));
+}
+
+/*
+ * printnuma - prints the peak heap size of each NUMA node region in the
+ *     last run of the trace
+ */
+static void printnuma(void)
+{
+    int node;
+
+    for (node = 0; node < mem_numa_nodes(); node++)
+	printf("node %d: peak heap %lu bytes\n", node,
+	       (unsigned long)mem_numa_peaksize(node));
+}
+
+/*
+ * printheapstats - prints the heap statistics hs[0] at the peak and
+ *     hs[1] at the end of a trace, then their free blocks by size class
+ */
+static void printheapstats(heapstats_t *hs, int n)
+{
+    static char *points[] = {"peak", "end"};
+    int i, c;
+
+    printf("%-6s%10s%5s%8s%10s%8s%10s%10s%6s%9s%9s%9s%7s%7s\n",
+	   "", "heap", "ext", "alloc", "bytes", "free", "bytes", "largest",
+	   "frag", "tags", "slab", "slabfree", "quick", "remote");
+    for (i = 0; i < n; i++)
+	printf("%-6s%10lu%5lu%8lu%10lu%8lu%10lu%10lu%6.2f%9lu%9lu%9lu%7lu%7lu\n",
+	       points[i],
+	       (unsigned long)hs[i].heap_size,
+	       (unsigned long)hs[i].extends,
+	       (unsigned long)hs[i].alloc_blocks,
+	       (unsigned long)hs[i].alloc_bytes,
+	       (unsigned long)hs[i].free_blocks,
+	       (unsigned long)hs[i].free_bytes,
+	       (unsigned long)hs[i].largest_free,
+	       hs[i].ext_frag,
+	       (unsigned long)hs[i].tag_bytes,
+	       (unsigned long)hs[i].slab_used,
+	       (unsigned long)hs[i].slab_free,
+	       (unsigned long)hs[i].quick_blocks,
+	       (unsigned long)hs[i].remote_blocks);
+
+    /* One line per size class that has free blocks at either point */
+    printf("%-6s%10s", "class", "from");
+    for (i = 0; i < n; i++)
+	printf("%8s%10s", points[i], "bytes");
+    printf("\n");
+    for (c = 0; c < hs[0].nclass; c++) {
+	for (i = 0; i < n && hs[i].class_blocks[c] == 0; i++)
+	    ;
+	if (i == n)
+	    continue;
+	printf("%-6d%10lu", c, (unsigned long)hs[0].class_min[c]);
+	for (i = 0; i < n; i++)
+	    printf("%8lu%10lu", (unsigned long)hs[i].class_blocks[c],
+		   (unsigned long)hs[i].class_bytes[c]);
+	printf("\n");
+    }
+}
+
+/*
+ * printlatency - prints the latency percentiles of each request type in
+ *     each valid trace, and over all of them
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    lathist_t total;
+    lathist_t *h;
+    int i, t, b;
+
+    printf("%5s  %-8s%8s%8s%8s%8s%10s\n", 
+	   "trace", "request", "count", "p50", "p99", "p999", "max");
+    for (t = 0; t < NUM_OPTYPES; t++) {
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i <= n; i++) {
+	    if (i < n && !stats[i].valid)
+		continue;
+	    h = i < n ? &stats[i].lat[t] : &total;
+	    if (h->count == 0)
+		continue;
+	    if (i < n)
+		printf("%2d%5s", i, "");
+	    else
+		printf("%-7s", "Total");
+	    printf("%-8s%8lu%8.0f%8.0f%8.0f%10.0f\n",
+		   optype_names[t],
+		   h->count,
+		   lat_percentile(h, 0.50),
+		   lat_percentile(h, 0.99),
+		   lat_percentile(h, 0.999),
+		   h->max);
+
+	    /* Accumulate the histograms of the traces */
+	    if (i < n) {
+		total.count += h->count;
+		for (b = 0; b < LAT_BUCKETS; b++)
+		    total.bucket[b] += h->bucket[b];
+		if (h->max > total.max)
+		    total.max = h->max;
+	    }
+	}
+    }
+}
+
+/*
+ * printevents - prints the event counts per request of each valid trace,
+ *     and over all of them
+ */
+static void printevents(int n, stats_t *stats)
+{
+    double events, ops;
+    int i, e;
+
+    printf("%5s", "trace");
+    for (e = 0; e < PERFCTR_NUM; e++)
+	printf("%10s", perfctr_name(e));
+    printf("\n");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("%2d%3s", i, "");
+	for (e = 0; e < PERFCTR_NUM; e++) {
+	    if (stats[i].events[e] < 0)
+		printf("%10s", "-");
+	    else
+		printf("%10.2f", stats[i].events[e] / stats[i].ops);
+	}
+	printf("\n");
+    }
+
+    /* The totals weigh each trace by its number of requests */
+    printf("%-5s", "Total");
+    for (e = 0; e < PERFCTR_NUM; e++) {
+	events = ops = 0;
+	for (i = 0; i < n; i++) {
+	    if (stats[i].valid && stats[i].events[e] >= 0) {
+		events += stats[i].events[e];
+		ops += stats[i].ops;
+	    }
+	}
+	if (ops == 0)
+	    printf("%10s", "-");
+	else
+	    printf("%10.2f", events / ops);
+    }
+    printf("\n");
+}
+
+/*
+ * printbench - prints the mean running time of each valid trace over the
+ *     warm and the cold trials, with the half width of its 95% confidence
+ *     interval and the standard deviation
+ */
+static void printbench(int n, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%12s%10s%10s%12s%10s%10s%8s\n",
+	   "trace", "warm secs", "+-95%", "stddev",
+	   "cold secs", "+-95%", "stddev", "Kops");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("%2d%3s%12.6f%10.6f%10.6f%12.6f%10.6f%10.6f%8.0f\n",
+	       i, "",
+	       stats[i].warm.mean,
+	       stats[i].warm.ci95,
+	       stats[i].warm.stddev,
+	       stats[i].cold.mean,
+	       stats[i].cold.ci95,
+	       stats[i].cold.stddev,
+	       (stats[i].ops/1e3)/stats[i].warm.mean);
+    }
+}
+
+/*
+ * putjsonstr - writes s to f as a JSON string
+ */
+static void putjsonstr(FILE *f, char *s)
+{
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+	if (*s == '"' || *s == '\\')
+	    fprintf(f, "\\%c", *s);
+	else if ((unsigned char)*s < 0x20)
+	    fprintf(f, "\\u%04x", (unsigned char)*s);
+	else
+	    fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/*
+ * putjsonbench - writes the trials b of a trace to f as a JSON object
+ */
+static void putjsonbench(FILE *f, bench_t *b, double ops)
+{
+    fprintf(f, "{\"trials\": %d, \"mean\": %.9f, \"stddev\": %.9f, "
+	    "\"ci95\": %.9f, \"min\": %.9f, \"max\": %.9f, \"kops\": %.3f}",
+	    b->trials, b->mean, b->stddev, b->ci95, b->min, b->max,
+	    (ops/1e3)/b->mean);
+}
+
+/*
+ * writeresults - writes the results of the mm package on each trace to
+ *     path, as JSON if its name ends in .json and as CSV otherwise: one
+ *     object or row per trace, with the warm and cold trials if there
+ *     were any (-B)
+ */
+static void writeresults(char *path, char **tracefiles, int n, stats_t *stats,
+			 double perfindex, int trials, int cpu)
+{
+    FILE *f;
+    char *q;
+    int i, json = strcmp(path + strlen(path) - 5, ".json") == 0;
+
+    if ((f = fopen(path, "w")) == NULL)
+	unix_error("ERROR: could not open the output file");
+
+    if (json) {
+	fprintf(f, "{\n  \"team\": ");
+	putjsonstr(f, team.teamname);
+	fprintf(f, ",\n  \"trials\": %d,\n  \"cpu\": %d,\n  \"perfindex\": %.3f,\n"
+		"  \"traces\": [", trials, cpu, perfindex);
+	for (i = 0; i < n; i++) {
+	    fprintf(f, "%s\n    {\"trace\": ", i > 0 ? "," : "");
+	    putjsonstr(f, tracefiles[i]);
+	    fprintf(f, ", \"valid\": %s, \"ops\": %.0f", 
+		    stats[i].valid ? "true" : "false", stats[i].ops);
+	    if (stats[i].valid) {
+		fprintf(f, ", \"util\": %.6f, \"secs\": %.9f, \"kops\": %.3f",
+			stats[i].util, stats[i].secs,
+			(stats[i].ops/1e3)/stats[i].secs);
+		if (trials > 0) {
+		    fprintf(f, ",\n     \"warm\": ");
+		    putjsonbench(f, &stats[i].warm, stats[i].ops);
+		    fprintf(f, ",\n     \"cold\": ");
+		    putjsonbench(f, &stats[i].cold, stats[i].ops);
+		}
+	    }
+	    fprintf(f, "}");
+	}
+	fprintf(f, "\n  ]\n}\n");
+    }
+    else {
+	fprintf(f, "trace,valid,ops,util,secs,kops,"
+		"warm_trials,warm_mean,warm_stddev,warm_ci95,warm_min,warm_max,"
+		"cold_trials,cold_mean,cold_stddev,cold_ci95,cold_min,cold_max\n");
+	for (i = 0; i < n; i++) {
+	    /* Quote the trace name, doubling its quotes */
+	    fputc('"', f);
+	    for (q = tracefiles[i]; *q != '\0'; q++) {
+		if (*q == '"')
+		    fputc('"', f);
+		fputc(*q, f);
+	    }
+	    fprintf(f, "\",%d,%.0f", stats[i].valid, stats[i].ops);
+	    if (!stats[i].valid)
+		fprintf(f, ",,,,,,,,,,,,,,,");
+	    else {
+		fprintf(f, ",%.6f,%.9f,%.3f", stats[i].util, stats[i].secs,
+			(stats[i].ops/1e3)/stats[i].secs);
+		if (trials == 0)
+		    fprintf(f, ",,,,,,,,,,,,");
+		else
+		    fprintf(f, ",%d,%.9f,%.9f,%.9f,%.9f,%.9f"
+			    ",%d,%.9f,%.9f,%.9f,%.9f,%.9f",
+			    stats[i].warm.trials, stats[i].warm.mean,
+			    stats[i].warm.stddev, stats[i].warm.ci95,
+			    stats[i].warm.min, stats[i].warm.max,
+			    stats[i].cold.trials, stats[i].cold.mean,
+			    stats[i].cold.stddev, stats[i].cold.ci95,
+			    stats[i].cold.min, stats[i].cold.max);
+	    }
+	    fprintf(f, "\n");
+	}
+    }
+    if (fclose(f) != 0)
+	unix_error("ERROR: could not write the output file");
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -1007,10 +2168,20 @@ static void usage(void)
     fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file (more than once for more files).\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print request latency percentiles (cycle counter).\n");
+    fprintf(stderr, "\t-P         Print hardware events per request (perf_event).\n");
+    fprintf(stderr, "\t-T <n>     Replay the traces on 1, 2, 4, ... n threads at once.\n");
+    fprintf(stderr, "\t-s         With -T, split each trace among the threads.\n");
+    fprintf(stderr, "\t-x         With -T, free blocks on another thread.\n");
+    fprintf(stderr, "\t-H         Print heap statistics at the peak and end of each trace.\n");
+    fprintf(stderr, "\t-B <n>     Time n warm and n cold trials of each trace.\n");
+    fprintf(stderr, "\t-c <cpu>   Pin the driver to CPU cpu.\n");
+    fprintf(stderr, "\t-o <file>  Write the results to file, in JSON (.json) or CSV (.csv).\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to n traces at once, one process and CPU each.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
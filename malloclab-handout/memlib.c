@@ -2,36 +2,254 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *            With USE_VM (config.h) the heap is real virtual memory instead:
+ *            one reserved range whose pages are committed as the brk moves.
+ *            With VM_NUMA as well, the range is split into one region per
+ *            NUMA node, each with a brk of its own and its pages on its node.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <string.h>
 #include <errno.h>
 
 #include "memlib.h"
 #include "config.h"
 
+#if USE_VM && VM_NUMA == 2
+#include <linux/mempolicy.h>
+#endif
+
+/* a region mapped by mem_map, outside of the heap */
+typedef struct map_t {
+    char *lo;                /* first byte of the region */
+    size_t size;             /* length of the region in bytes */
+    struct map_t *next;
+} map_t;
+
+/* the heap of one NUMA node, a part of the storage with a brk of its own */
+typedef struct {
+    char *start_brk;         /* points to first byte of the region */
+    char *brk;               /* points to last byte of its heap */
+    char *max_addr;          /* largest legal address of the region */
+    char *zero;              /* bytes from here on still hold zeros */
+    size_t peak;             /* high water mark of its heap size */
+#if USE_VM
+    char *commit_brk;        /* end of the committed part of the region */
+#endif
+} region_t;
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static region_t mem_regions[VM_MAXNODE];  /* heap regions, by node */
+static int mem_nregions;     /* number of heap regions */
+static map_t *mem_maps;      /* regions mapped by mem_map */
+static map_t *mem_nodes;     /* unused registry nodes */
+static size_t mem_mapped;    /* total bytes of the mapped regions */
+static size_t mem_peak;      /* high water mark of heap plus mapped bytes */
+#if USE_VM
+static char *mem_reserve;    /* start of the reserved address range */
+static size_t mem_reserved;  /* length of the reserved address range */
+static size_t mem_granule;   /* commit granularity in bytes */
+#endif
+
+/*
+ * mem_update_peak - raise the high water marks of region r and of the
+ *    whole footprint
+ */
+static void mem_update_peak(region_t *r)
+{
+    size_t footprint = mem_heapsize() + mem_mapped;
+
+    if (r != NULL && (size_t)(r->brk - r->start_brk) > r->peak)
+	r->peak = (size_t)(r->brk - r->start_brk);
+    if (footprint > mem_peak)
+	mem_peak = footprint;
+}
+
+/*
+ * mem_node - take a registry node, from a page mapped for nodes when none
+ *    is left. The registry never calls the libc malloc, which mm.c may be
+ *    standing in for.
+ */
+static map_t *mem_node(void)
+{
+    map_t *p;
+    size_t i, n = mem_pagesize() / sizeof(map_t);
+
+    if (mem_nodes == NULL) {
+	if ((p = mmap(NULL, mem_pagesize(), PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	    return NULL;
+	for (i = 0; i < n; i++) {
+	    p[i].next = mem_nodes;
+	    mem_nodes = &p[i];
+	}
+    }
+    p = mem_nodes;
+    mem_nodes = p->next;
+    return p;
+}
+
+/*
+ * mem_node_free - give a registry node back
+ */
+static void mem_node_free(map_t *p)
+{
+    p->next = mem_nodes;
+    mem_nodes = p;
+}
+
+#if USE_VM
+/*
+ * mem_commit - make the heap of region r up to brk accessible, a granule
+ *    at a time. With VM_NUMA == 2 the new pages are bound to its node.
+ */
+static int mem_commit(region_t *r, char *brk)
+{
+    size_t end = ((size_t)(brk - r->start_brk) + mem_granule - 1) & ~(mem_granule - 1);
+    char *new_commit = r->start_brk + end;
+#if VM_NUMA == 2
+    unsigned long mask = 1UL << (r - mem_regions);
+#endif
+
+    if (new_commit <= r->commit_brk)
+	return 0;
+#if VM_HUGEPAGE == 2
+    /* explicit huge pages are taken from the pool now, or normal pages */
+    /* are mapped in their place (a failed attempt may drop the range) */
+    if (mmap(r->commit_brk, new_commit - r->commit_brk, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) == MAP_FAILED &&
+	mmap(r->commit_brk, new_commit - r->commit_brk, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+	return -1;
+#else
+    if (mprotect(r->commit_brk, new_commit - r->commit_brk, 
+		 PROT_READ | PROT_WRITE) < 0)
+	return -1;
+#endif
+#if VM_NUMA == 2
+    /* placement is only a hint: a kernel without NUMA support keeps running */
+    syscall(SYS_mbind, r->commit_brk, (unsigned long)(new_commit - r->commit_brk),
+	    MPOL_BIND, &mask, (unsigned long)(8 * sizeof(mask)), 0);
+#endif
+    r->commit_brk = new_commit;
+    return 0;
+}
+
+/*
+ * mem_decommit - give the whole granules of region r above brk back to
+ *    the system
+ */
+static void mem_decommit(region_t *r, char *brk)
+{
+    size_t end = ((size_t)(brk - r->start_brk) + mem_granule - 1) & ~(mem_granule - 1);
+    char *new_commit = r->start_brk + end;
+
+    if (new_commit >= r->commit_brk)
+	return;
+    /* a fresh reservation over the granules drops their pages */
+    mmap(new_commit, r->commit_brk - new_commit, PROT_NONE,
+	 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    r->commit_brk = new_commit;
+    if (r->zero > new_commit)
+	r->zero = new_commit;
+}
+#endif
+
+#if USE_VM && VM_NUMA
+/*
+ * mem_count_nodes - return the number of NUMA nodes of the system, the
+ *    highest in /sys/devices/system/node/possible plus one. It reads the
+ *    file without stdio, which would call the libc malloc.
+ */
+static int mem_count_nodes(void)
+{
+    char buf[64];
+    int fd, n = 0;
+    ssize_t len;
+    char *p;
+
+    if ((fd = open("/sys/devices/system/node/possible", O_RDONLY)) < 0)
+	return 1;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+	return 1;
+    buf[len] = '\0';
+
+    /* a list of ranges such as "0-3,8-11": the last number is the highest */
+    for (p = buf; *p != '\0'; p++)
+	if (*p >= '0' && *p <= '9')
+	    n = (p > buf && p[-1] >= '0' && p[-1] <= '9' ? 10 * n : 0) + *p - '0';
+    return n + 1;
+}
+#endif
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    region_t *r;
+    char *start;
+    size_t size;
+    int i;
+
+#if USE_VM
+    /* reserve the address range without committing it */
+    mem_granule = VM_HUGEPAGE ? VM_HUGESIZE : mem_pagesize();
+    mem_reserved = VM_RESERVE + (VM_HUGEPAGE ? VM_HUGESIZE : 0);
+    if ((mem_reserve = mmap(NULL, mem_reserved, PROT_NONE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			    -1, 0)) == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
+	exit(1);
+    }
+
+    /* huge pages need a heap aligned to the huge page size */
+    start = mem_reserve;
+#if VM_HUGEPAGE
+    start += (VM_HUGESIZE - (size_t)mem_reserve % VM_HUGESIZE) % VM_HUGESIZE;
+#endif
+#if VM_HUGEPAGE == 1
+    madvise(start, VM_RESERVE, MADV_HUGEPAGE);
+#endif
+    size = VM_RESERVE;               /* max legal heap size */
+#else
+    /* allocate the storage we will use to model the available VM, zeroed */
+    /* like fresh pages */
+    if ((start = (char *)calloc(1, MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
+    size = MAX_HEAP;                 /* max legal heap size */
+#endif
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    /* one region per node, on granule boundaries, or the whole storage */
+#if USE_VM && VM_NUMA
+    mem_nregions = mem_count_nodes();
+    if (mem_nregions > VM_MAXNODE)
+	mem_nregions = VM_MAXNODE;
+    size = (size / mem_nregions) & ~(mem_granule - 1);
+#else
+    mem_nregions = 1;
+#endif
+    for (i = 0; i < mem_nregions; i++) {
+	r = &mem_regions[i];
+	r->start_brk = start + i * size;
+	r->max_addr = r->start_brk + size;    /* max legal region address */
+	r->brk = r->start_brk;                /* heap is empty initially */
+	r->zero = r->start_brk;
+	r->peak = 0;
+#if USE_VM
+	r->commit_brk = r->start_brk;
+#endif
+    }
 }
 
 /* 
@@ -39,57 +257,282 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+#if USE_VM
+    munmap(mem_reserve, mem_reserved);
+#else
+    free(mem_regions[0].start_brk);
+#endif
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make an empty heap,
+ *    unmap every mapped region and clear the high water marks. With USE_VM
+ *    the committed pages are given back as well.
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    map_t *p;
+    int i;
+
+    while ((p = mem_maps) != NULL) {
+	mem_maps = p->next;
+	munmap(p->lo, p->size);
+	mem_node_free(p);
+    }
+    mem_mapped = 0;
+    mem_peak = 0;
+    for (i = 0; i < mem_nregions; i++) {
+	mem_regions[i].brk = mem_regions[i].start_brk;
+	mem_regions[i].peak = 0;
+#if USE_VM
+	mem_decommit(&mem_regions[i], mem_regions[i].brk);
+#endif
+    }
 }
 
-/* 
- * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+/*
+ * mem_numa_sbrk - simple model of the sbrk function on the heap region
+ *    of node. Extends it by incr bytes and returns the start address of
+ *    the new area. A negative incr shrinks it, but never below its first
+ *    byte.
  */
-void *mem_sbrk(int incr) 
+void *mem_numa_sbrk(int node, int incr)
 {
-    char *old_brk = mem_brk;
+    region_t *r = &mem_regions[node];
+    char *old_brk = r->brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( (incr < 0 && (r->brk - r->start_brk) < -incr) ||
+	 (incr > 0 && (r->brk + incr) > r->max_addr)
+#if USE_VM
+	 || (incr > 0 && mem_commit(r, r->brk + incr) < 0)
+#endif
+	) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
-    mem_brk += incr;
+    r->brk += incr;
+    if (r->brk > r->zero)
+	r->zero = r->brk;
+#if USE_VM
+    if (incr < 0)
+	mem_decommit(r, r->brk);
+#endif
+    mem_update_peak(r);
     return (void *)old_brk;
 }
 
+/* 
+ * mem_sbrk - mem_numa_sbrk on the first region, which holds the heap
+ *    start. It is the only region without VM_NUMA.
+ */
+void *mem_sbrk(int incr) 
+{
+    return mem_numa_sbrk(0, incr);
+}
+
+/*
+ * mem_map - model of an anonymous mmap. Maps a page-aligned region of at
+ *    least size bytes outside of the heap and returns its address, or
+ *    (void *)-1 on failure.
+ */
+void *mem_map(size_t size)
+{
+    map_t *p;
+    char *lo;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if ((p = mem_node()) == NULL ||
+	(lo = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+	if (p != NULL)
+	    mem_node_free(p);
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    p->lo = lo;
+    p->size = size;
+    p->next = mem_maps;
+    mem_maps = p;
+    mem_mapped += size;
+    mem_update_peak(NULL);
+    return (void *)lo;
+}
+
+/*
+ * mem_unmap - unmap the region returned by mem_map at lo. Returns 0, or
+ *    -1 if lo is not a mapped region.
+ */
+int mem_unmap(void *lo)
+{
+    map_t **pp, *p;
+
+    for (pp = &mem_maps; (p = *pp) != NULL; pp = &p->next) {
+	if (p->lo == (char *)lo) {
+	    *pp = p->next;
+	    munmap(p->lo, p->size);
+	    mem_mapped -= p->size;
+	    mem_node_free(p);
+	    return 0;
+	}
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * mem_shrink - shrink the region mapped at lo to the size bytes at newlo,
+ *    page-aligned and within it, unmapping the pages on either side.
+ *    Returns 0, or -1 if lo is not a mapped region or newlo..size is not
+ *    within it.
+ */
+int mem_shrink(void *lo, void *newlo, size_t size)
+{
+    map_t *p;
+    char *hi;
+
+    for (p = mem_maps; p != NULL; p = p->next) {
+	if (p->lo != (char *)lo)
+	    continue;
+	hi = (char *)newlo + size;
+	if ((char *)newlo < p->lo || hi > p->lo + p->size || size == 0)
+	    break;
+	if ((char *)newlo > p->lo)
+	    munmap(p->lo, (char *)newlo - p->lo);
+	if (hi < p->lo + p->size)
+	    munmap(hi, p->lo + p->size - hi);
+	mem_mapped -= p->size - size;
+	p->lo = (char *)newlo;
+	p->size = size;
+	return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * mem_is_mapped - tell if the bytes lo..hi lie within one mapped region
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    map_t *p;
+
+    for (p = mem_maps; p != NULL; p = p->next)
+	if ((char *)lo >= p->lo && (char *)hi < p->lo + p->size)
+	    return 1;
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
 void *mem_heap_lo()
 {
-    return (void *)mem_start_brk;
+    return (void *)mem_regions[0].start_brk;
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, that of the highest
+ *    region in use: the regions below may end in gaps of unused storage
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    int i = mem_nregions - 1;
+
+    while (i > 0 && mem_regions[i].brk == mem_regions[i].start_brk)
+	i--;
+    return (void *)(mem_regions[i].brk - 1);
+}
+
+/*
+ * mem_heap_zero - return address of the first byte of the first region
+ *    from which the storage holds zeros: it has not been handed out by
+ *    mem_sbrk since it was last cleared
+ */
+void *mem_heap_zero()
+{
+    return mem_numa_zero(0);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, over all regions
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < mem_nregions; i++)
+	size += (size_t)(mem_regions[i].brk - mem_regions[i].start_brk);
+    return size;
+}
+
+/*
+ * mem_peaksize() - returns the high water mark of the heap size plus the
+ *    mapped bytes since the last mem_reset_brk
+ */
+size_t mem_peaksize()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_numa_nodes - returns the number of heap regions, one per NUMA node
+ *    with VM_NUMA (up to VM_MAXNODE), else one
+ */
+int mem_numa_nodes()
+{
+    return mem_nregions;
+}
+
+/*
+ * mem_numa_node - returns the node of the CPU the caller runs on, as a
+ *    region number
+ */
+int mem_numa_node()
+{
+    unsigned int cpu, node = 0;
+
+    if (mem_nregions == 1 || syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+	return 0;
+    return (int)(node % mem_nregions);
+}
+
+/*
+ * mem_numa_hi - return address of the last heap byte of the region of
+ *    node, a byte below the region if its heap is empty
+ */
+void *mem_numa_hi(int node)
+{
+    return (void *)(mem_regions[node].brk - 1);
+}
+
+/*
+ * mem_numa_zero - return address of the first byte of the region of node
+ *    from which the storage holds zeros
+ */
+void *mem_numa_zero(int node)
+{
+    return (void *)mem_regions[node].zero;
+}
+
+/*
+ * mem_numa_heapsize - returns the heap size of the region of node in bytes
+ */
+size_t mem_numa_heapsize(int node)
+{
+    return (size_t)(mem_regions[node].brk - mem_regions[node].start_brk);
+}
+
+/*
+ * mem_numa_peaksize - returns the high water mark of the heap size of the
+ *    region of node since the last mem_reset_brk
+ */
+size_t mem_numa_peaksize(int node)
+{
+    return mem_regions[node].peak;
 }
 
 /*
@@ -3,9 +3,24 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_map(size_t size);
+int mem_unmap(void *lo);
+int mem_shrink(void *lo, void *newlo, size_t size);
+int mem_is_mapped(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_zero(void);
 size_t mem_heapsize(void);
+size_t mem_peaksize(void);
 size_t mem_pagesize(void);
 
+/* heap regions of the NUMA nodes, mem_sbrk being that of node 0 */
+void *mem_numa_sbrk(int node, int incr);
+int mem_numa_nodes(void);
+int mem_numa_node(void);
+void *mem_numa_hi(int node);
+void *mem_numa_zero(int node);
+size_t mem_numa_heapsize(int node);
+size_t mem_numa_peaksize(int node);
+
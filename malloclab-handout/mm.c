@@ -6,6 +6,19 @@
  * The lists are linked by the `pred` pointer and `succ` pointer, which points
  * to the predecessor and successor of one block. And it should be stressed
  * that blocks in size class lists are ordered by their payload, i.e. their sizes.
+ * (This is the FIT_BEST policy; FIT_FIRST and FIT_NEXT keep LIFO lists instead,
+ * and the class spacing, chunk size and split rule are build-time policies too.)
+ * A bitmap word after the list heads marks the non-empty classes, so find_fit
+ * jumps straight to the first usable class with a count-trailing-zeros.
+ * Classes from TREECLASS upward are not lists but treaps ordered by size (then
+ * address), whose `left` and `right` links reuse the `pred` and `succ` words,
+ * so large blocks get O(log n) best-fit insert, remove and search.
+ * Only free blocks carry a footer. Every header keeps a prev-alloc bit telling
+ * whether the block before it is allocated, so an allocated block's payload
+ * runs up to the next header and PREV_BLKP is only read when that bit is clear.
+ * Requests below SLABLIMIT bytes are served from slab runs (see run_new).
+ * All of the above is per arena, one per thread (see get_arena).
+ * Requests from MMAP_THRESHOLD bytes are mapped on their own (see map_block).
  *
  */
 #include <stdio.h>
@@ -13,6 +26,8 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -30,75 +45,410 @@ team_t team = {
     ""
 };
 
-/* single word (4) or double word (8) alignment */
+/* double word (8) alignment, or 16 bytes with -DALIGNMENT=16 as the C library gives on 64-bit hosts */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
 /* Align size to double words */
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
+/*
+ * Policies, which may also be set at build time with -D (see "make matrix").
+ * FIT_POLICY picks the block from a size class list: FIT_BEST the smallest, the lists
+ * being kept sorted by size, FIT_FIRST the first that fits in LIFO lists, FIT_NEXT the
+ * first that fits after the last block taken from LIFO lists. Treaps give the best fit.
+ * CLASS_EXACT gives each size below LISTLIMIT a list of its own, whose blocks all fit equally
+ * well: insert_list and remove_list take O(1), find_fit takes the first block, and FIT_POLICY
+ * only matters without it.
+ */
+#define FIT_BEST 0
+#define FIT_FIRST 1
+#define FIT_NEXT 2
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_BEST
+#endif
+#ifndef CLASS_EXACT
+#define CLASS_EXACT 1		/* Sizes below LISTLIMIT have a size class each */
+#endif
+#ifndef MAXCLASS
+#define MAXCLASS 16			/* Max number of size classes (even, at most 32, above TREECLASS) */
+#endif
+#ifndef CLASS_SHIFT
+#define CLASS_SHIFT 0		/* Size classes split each power of two in 2^n */
+#endif
+#ifndef CHUNKSIZE
+#define CHUNKSIZE (1<<12)	/* Extend heap by at least this amount (bytes, a power of two) */
+#endif
+#ifndef PLACE_SPLIT
+#define PLACE_SPLIT 96		/* Blocks from this size are placed at the end of a free block */
+#endif
+
 /* Basic constants and macros */
 #define WSIZE 4				/* Word and header/footer size (bytes) */
 #define DSIZE 8				/* Double word size (bytes) */
-#define CHUNKSIZE (1<<12)	/* Extend heap by this amount (bytes) */
-#define MAXCLASS 15			/* Max number of size classes (odd) */
+#define MAXCHUNK (1<<20)	/* Sustained growth doubles the chunk up to this amount */
+#define CHUNKSHIFT 7		/* ... and up to 1/2^n of the heap */
+#define GROWALIGN (1<<12)	/* Growth ends the heap on a multiple of this (page or huge page) */
+#define LISTLIMIT 128		/* Free blocks below this size are kept in lists */
+#define TREECLASS CLASS_IDX(LISTLIMIT)	/* First size class kept as a treap */
+#define RUNSHIFT 12			/* log2 of the slab run size */
+#define RUNSIZE (1<<RUNSHIFT)	/* Slab run size and alignment (bytes) */
+#define SLABLIMIT 96		/* Requests smaller than this are served from slab runs */
+#define NSLAB (SLABLIMIT / DSIZE)	/* Number of slot sizes: 8, 16, ..., SLABLIMIT */
+#define MAXARENA 64			/* Max number of arenas, further threads share them */
+#define MAXBOUND 16			/* Max number of arenas of mm_arena_create */
+#define MMAP_THRESHOLD (1<<17)	/* Requests from this size are mapped on their own */
+#define TRIM_THRESHOLD (1<<17)	/* A free top block from this size is given back */
+#define QUICKLIMIT 512		/* Freed blocks up to this size wait in quick lists */
+#define NQUICK ((QUICKLIMIT - SLABLIMIT) / DSIZE)	/* One quick list per block size above SLABLIMIT */
+#define REALLOC_HEADROOM 0	/* A resized block keeps 1/2^n spare bytes (0 for none) */
+#define REMOTE_SHRINK 1		/* A block of another arena shrunk to 1/2^n of its payload moves */
+#define MAXREQUEST (1u<<30)	/* Heap and arena blocks are smaller: sizes must fit a header word and mem_sbrk */
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
-/* Pack a size and allocated bit into a word */
+/* Pack a size and allocated bits into a word */
 #define PACK(size, alloc) ((size) | (alloc))
+#define PREV_ALLOC 0x2		/* Header bit: the previous block is allocated */
+#define FOREIGN 0x4			/* Header bit: allocated in another arena than the main one */
 
 /* Read and write a word at address P */
 #define GET(p) (*(unsigned int *)(p))
 #define PUT(p, val) (*(unsigned int *)(p) = (val))
-#define PUT_P(p, p_to) (*(unsigned int *)(p) = (unsigned int)(p_to))
+
+/*
+ * Pointers into the heap are stored in one word. In 64-bit mode that word holds
+ * their offset from a double word below the heap start, so 0 still stands for NULL,
+ * blocks keep the same overhead as in 32-bit mode and the heap may span up to 4 GB.
+ */
+#ifdef __LP64__
+#define PTR_OFF(p) ((p) == NULL ? 0u : (unsigned int)((char *)(p) - heap_base))
+#define OFF_PTR(off) ((off) == 0 ? NULL : heap_base + (off))
+#else
+#define PTR_OFF(p) ((unsigned int)(p))
+#define OFF_PTR(off) ((char *)(off))
+#endif
+
+/* Read and write a pointer at address P */
+#define GET_P(p) OFF_PTR(GET(p))
+#define PUT_P(p, p_to) PUT(p, PTR_OFF(p_to))
 
 /* Read the size and allocated fields from address P */
 #define GET_SIZE(p) (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define GET_FOREIGN(p) (GET(p) & FOREIGN)
+
+/* Set or clear the prev-alloc bit of the header at address P */
+#define SET_PREV_ALLOC(p) PUT(p, GET(p) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(p) PUT(p, GET(p) & ~PREV_ALLOC)
 
-/* Given block ptr bp, compute address of its header and footer */
+/* Given block ptr bp, compute address of its header and footer (free blocks only) */
 #define HDRP(bp) ((char *)(bp) - WSIZE)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous (free only) blocks */
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
+/* Adjusted block size for a request: header and alignment, at least a free block */
+#define ASIZE(size) ((size) <= DSIZE + WSIZE ? 2 * DSIZE : ALIGN((size) + WSIZE))
+
 /* Given block ptr bp, compute its predecessor and successor pointers */
 #define PRED_PTR(bp) ((char *)(bp))
 #define SUCC_PTR(bp) ((char *)(bp) + WSIZE)
 
 /* Given block ptr bp, compute address of predecessor and successor blocks */
-#define PRED(bp) (*(char **)(bp))
-#define SUCC(bp) (*(char **)(SUCC_PTR(bp)))
+#define PRED(bp) GET_P(PRED_PTR(bp))
+#define SUCC(bp) GET_P(SUCC_PTR(bp))
+
+/* Given block ptr bp in a tree class, compute address of its left and right children */
+#define LEFT_PTR(bp) PRED_PTR(bp)
+#define RIGHT_PTR(bp) SUCC_PTR(bp)
+#define LEFT(bp) PRED(bp)
+#define RIGHT(bp) SUCC(bp)
+
+/* Treap key order (size, then address) and heap priority (address hash) */
+#define TREE_LESS(a, b) (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) || \
+	(GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (char *)(a) < (char *)(b)))
+#define PRIO(bp) ((unsigned int)(unsigned long)(bp) * 2654435761u)
+
+/* Given size, compute floor(log2(size)) in steps of 1/2^CLASS_SHIFT, with a count-leading-zeros */
+#define CLASS_LOG(size) (31 - __builtin_clz(size))
+#define LOG_CLASS(size) ((int)((CLASS_LOG(size) << CLASS_SHIFT) | \
+	(((size) >> (CLASS_LOG(size) - CLASS_SHIFT)) & ((1 << CLASS_SHIFT) - 1))))
+
+/* Given size, compute index of its size class: the log class, or with CLASS_EXACT the size */
+/* in double words below LISTLIMIT and the log classes after those, capped */
+#if CLASS_EXACT
+#define CLASS_IDX(size) ((size) < LISTLIMIT ? (int)((size) / DSIZE) - 2 : \
+	MIN(LOG_CLASS(size) - LOG_CLASS(LISTLIMIT) + LISTLIMIT / DSIZE - 2, MAXCLASS - 1))
+#else
+#define CLASS_IDX(size) MIN(LOG_CLASS(size), MAXCLASS - 1)
+#endif
+
+/* Given class index, compute address of its list head in the current arena; address of the bitmap */
+#define CLASS_PTR(idx) ((char *)arena_listp + (idx) * WSIZE)
+#define BITMAP_PTR ((char *)arena_listp + MAXCLASS * WSIZE)
+
+/* Given slot size index, compute address of its partial run list head in the current arena */
+#define SLAB_PTR(idx) ((char *)arena_listp + (MAXCLASS + 1 + (idx)) * WSIZE)
+#define SLAB_IDX(size) ((ALIGN(size) / DSIZE) - 1)
+
+/* Given arena ptr a, compute address of its lock, its epilogue pointer, the next arena, */
+/* its owner state (ARENA_OWNED, ARENA_SHARED, ARENA_ORPHAN or ARENA_BOUND) and the head of its */
+/* remote free queue */
+#define LOCK_PTR(a) ((char *)(a) + (MAXCLASS + 1 + NSLAB) * WSIZE)
+#define TOP_PTR(a) ((char *)(a) + (MAXCLASS + 2 + NSLAB) * WSIZE)
+#define NEXT_ARENA(a) ((char *)(a) + (MAXCLASS + 3 + NSLAB) * WSIZE)
+#define SHARED_PTR(a) ((char *)(a) + (MAXCLASS + 4 + NSLAB) * WSIZE)
+#define REMOTE_PTR(a) ((char *)(a) + (MAXCLASS + 5 + NSLAB) * WSIZE)
+#define GROW_PTR(a) ((char *)(a) + (MAXCLASS + 6 + NSLAB) * WSIZE)	/* Next growth chunk */
+#define ZERO_PTR(a) ((char *)(a) + (MAXCLASS + 7 + NSLAB) * WSIZE)	/* Start of the zero top of its last segment */
+#define ROVER_PTR(a) ((char *)(a) + (MAXCLASS + 8 + NSLAB) * WSIZE)	/* Next fit resumes here */
+#define NODE_PTR(a) ((char *)(a) + (MAXCLASS + 9 + NSLAB) * WSIZE)	/* Heap region it grows in */
+#define ARENAWORDS ((MAXCLASS + 11 + NSLAB + NQUICK) & ~1)	/* Words of an arena (even) */
 
-/* Size class list pointer */
+/* Owner states of an arena: one thread's, shared under its lock, left by its exited */
+/* thread, under its lock until another thread adopts it, or of mm_arena_create, under its lock */
+#define ARENA_OWNED 0
+#define ARENA_SHARED 1
+#define ARENA_ORPHAN 2
+#define ARENA_BOUND 3
+#define ARENA_LOCKED(a) (GET(SHARED_PTR(a)) == ARENA_SHARED || GET(SHARED_PTR(a)) == ARENA_BOUND)
+#define ARENA_STATE(a) __atomic_load_n((unsigned int *)SHARED_PTR(a), __ATOMIC_ACQUIRE)
+
+/* Given block size, compute index of its quick list; address of its head in the current arena */
+#define QUICK_IDX(size) ((size) / DSIZE - SLABLIMIT / DSIZE - 1)
+#define QUICK_PTR(idx) ((char *)arena_listp + (MAXCLASS + 10 + NSLAB + (idx)) * WSIZE)
+#define IS_QUICK(size) ((size) > SLABLIMIT && (size) <= QUICKLIMIT)
+
+/* Heap-wide words after the main arena: page map pointer and length (pages), heap lock, */
+/* number of arenas of their own (not shared), and the arenas of mm_arena_create by index */
+#define PAGEMAP_PTR ((char *)heap_listp + ARENAWORDS * WSIZE)
+#define PAGEMAP_LEN ((char *)heap_listp + (ARENAWORDS + 1) * WSIZE)
+#define HEAPLOCK_PTR ((char *)heap_listp + (ARENAWORDS + 2) * WSIZE)
+#define NARENAS_PTR ((char *)heap_listp + (ARENAWORDS + 3) * WSIZE)
+#define SEGS_PTR ((char *)heap_listp + (ARENAWORDS + 4) * WSIZE)	/* Last segment opened */
+#define NBOUND_PTR ((char *)heap_listp + (ARENAWORDS + 5) * WSIZE)
+#define BOUND_PTR(i) ((char *)heap_listp + (ARENAWORDS + 6 + (i)) * WSIZE)
+/* Words before the prologue, as many as puts the first payload on ALIGNMENT */
+#define LISTWORDS (ALIGN((ARENAWORDS + MAXBOUND + 9) * WSIZE) / WSIZE - 3)
+
+/* Given allocated block ptr bp, compute the bytes it can hold (less the owner word if foreign) */
+#define PAYLOAD_SIZE(bp) (GET_SIZE(HDRP(bp)) - (GET_FOREIGN(HDRP(bp)) ? DSIZE : WSIZE))
+
+/* Adjusted block size for a request in the current arena, room for the owner word if foreign */
+#define ARENA_ASIZE(size) ASIZE(arena_listp == heap_listp ? (size) : (size) + WSIZE)
+
+/* Given the end p of a block handed out in the current arena, keep the zero top above it */
+/* and remember where it was for mm_calloc */
+#define SET_DIRTY(p) do { if ((char *)(p) > (cut_zero = GET_P(ZERO_PTR(arena_listp)))) \
+	PUT_P(ZERO_PTR(arena_listp), (p)); } while (0)
+
+/* Given arena ptr a, compute its node, and the end of the heap region of that node */
+#define NODE(a) ((int)GET(NODE_PTR(a)))
+#define NODE_BRK(a) ((char *)mem_numa_hi(NODE(a)) + 1)
+
+/* Given address p, round it down to a multiple of GROWALIGN */
+#define GROW_FLOOR(p) ((char *)((unsigned long)(p) & ~(unsigned long)(GROWALIGN - 1)))
+
+/* Bytes of a mapped block before its payload, which end with the length of its mapping */
+#define MAP_PAD ALIGN(sizeof(size_t))
+
+/* Given mapped block ptr bp, compute the length and the start of its mapping, and its payload size */
+#define MAP_LEN(bp) (((size_t *)(bp))[-1])
+#define MAP_BASE(bp) ((char *)((unsigned long)((char *)(bp) - MAP_PAD) & ~(unsigned long)(mem_pagesize() - 1)))
+#define MAP_PAYLOAD(bp) ((size_t)(MAP_BASE(bp) + MAP_LEN(bp) - (char *)(bp)))
+
+/* Given block ptr bp, tell if it was mapped on its own outside of the heap */
+#define IS_MAPPED(bp) ((char *)(bp) < (char *)heap_listp || (char *)(bp) > (char *)mem_heap_hi())
+
+/* Page map tags */
+#define PAGE_SLAB 1			/* The page is a slab run */
+
+/* Given address p, compute its page map index and the run it would belong to */
+#define PAGE_IDX(p) (((unsigned long)(p) >> RUNSHIFT) - ((unsigned long)heap_listp >> RUNSHIFT))
+#define RUNP(p) ((char *)((unsigned long)(p) & ~(unsigned long)(RUNSIZE - 1)))
+
+/* Given run ptr r, compute address of its header words and its i-th bitmap word (1 = free slot) */
+#define RUN_SLOTSIZE(r) ((char *)(r))
+#define RUN_NSLOTS(r) ((char *)(r) + WSIZE)
+#define RUN_NFREE(r) ((char *)(r) + 2 * WSIZE)
+#define RUN_NEXT(r) ((char *)(r) + 3 * WSIZE)
+#define RUN_PREV(r) ((char *)(r) + 4 * WSIZE)
+#define RUN_ARENA(r) ((char *)(r) + 5 * WSIZE)
+#define RUN_MAP(r, i) ((char *)(r) + (6 + (i)) * WSIZE)
+#define RUN_MAPWORDS 16		/* Enough bits for RUNSIZE / DSIZE slots */
+#define RUN_HDR ALIGN((6 + RUN_MAPWORDS) * WSIZE)	/* Run header size, slots start here */
+
+/* Main arena pointer, at the start of the heap; heap-wide words follow it */
 void* heap_listp;
 
+/* Base of the stored pointer offsets, a double word below heap_listp */
+static char* heap_base;
+
+/* Arena the current operation works on, and the arena of this thread */
+static __thread void* arena_listp;
+static __thread void* thread_arena;
+
+/* Zero top of the arena when the last block was placed */
+static __thread char* cut_zero;
+
+/* Bumped by mm_init so that threads drop arenas of an old heap */
+static unsigned int heap_gen;
+static __thread unsigned int arena_gen;
+
+/* Thread-specific key whose destructor leaves the arena of an exiting thread */
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+/* Heap extensions since mm_init, counted under the heap lock */
+static unsigned int heap_extends;
+
+/*
+ * lock - Spin on the lock word at lockp, yielding the CPU while it is held.
+ */
+static void lock(void* lockp)
+{
+	while (__sync_lock_test_and_set((unsigned int *)lockp, 1))
+		while (*(volatile unsigned int *)lockp)
+			sched_yield();
+}
+
+/*
+ * unlock - Release the lock word at lockp.
+ */
+static void unlock(void* lockp)
+{
+	__sync_lock_release((unsigned int *)lockp);
+}
+
+/*
+ * rotate_right - Lift the left child of the node linked from linkp into its place.
+ */
+static void rotate_right(void* linkp)
+{
+	void* node = GET_P(linkp);
+	void* child = LEFT(node);
+
+	PUT_P(LEFT_PTR(node), RIGHT(child));
+	PUT_P(RIGHT_PTR(child), node);
+	PUT_P(linkp, child);
+}
+
+/*
+ * rotate_left - Lift the right child of the node linked from linkp into its place.
+ */
+static void rotate_left(void* linkp)
+{
+	void* node = GET_P(linkp);
+	void* child = RIGHT(node);
+
+	PUT_P(RIGHT_PTR(node), LEFT(child));
+	PUT_P(LEFT_PTR(child), node);
+	PUT_P(linkp, child);
+}
+
+/*
+ * tree_insert - Insert ptr bp into the treap linked from linkp, restoring
+ *     heap order by rotations on the way back up.
+ */
+static void tree_insert(void* linkp, void* bp)
+{
+	void* node = GET_P(linkp);
+
+	if (node == NULL) {
+		PUT_P(LEFT_PTR(bp), NULL);
+		PUT_P(RIGHT_PTR(bp), NULL);
+		PUT_P(linkp, bp);
+	}
+	else if (TREE_LESS(bp, node)) {
+		tree_insert(LEFT_PTR(node), bp);
+		if (PRIO(LEFT(node)) > PRIO(node))
+			rotate_right(linkp);
+	}
+	else {
+		tree_insert(RIGHT_PTR(node), bp);
+		if (PRIO(RIGHT(node)) > PRIO(node))
+			rotate_left(linkp);
+	}
+}
+
+/*
+ * tree_remove - Remove ptr bp from the treap linked from linkp by rotating it
+ *     down to a leaf. bp must still carry the size it was inserted with.
+ */
+static void tree_remove(void* linkp, void* bp)
+{
+	void* node;
+
+	/* Search the link pointing to bp */
+	while ((node = GET_P(linkp)) != bp)
+		linkp = TREE_LESS(bp, node) ? LEFT_PTR(node) : RIGHT_PTR(node);
+
+	/* Rotate the child with higher priority up until bp is a leaf */
+	while (LEFT(bp) != NULL || RIGHT(bp) != NULL) {
+		if (RIGHT(bp) == NULL || (LEFT(bp) != NULL && PRIO(LEFT(bp)) > PRIO(RIGHT(bp)))) {
+			rotate_right(linkp);
+			linkp = RIGHT_PTR(GET_P(linkp));
+		}
+		else {
+			rotate_left(linkp);
+			linkp = LEFT_PTR(GET_P(linkp));
+		}
+	}
+	PUT_P(linkp, NULL);
+}
+
+/*
+ * tree_fit - Best fit in a treap: the smallest block of at least asize bytes.
+ */
+static void* tree_fit(void* root, size_t asize)
+{
+	void* fit = NULL;
+
+	while (root != NULL) {
+		if (GET_SIZE(HDRP(root)) >= asize) {
+			fit = root;
+			root = LEFT(root);
+		}
+		else
+			root = RIGHT(root);
+	}
+	return fit;
+}
+
 /*
  * Insert ptr bp to appropriate position in segregated free list.
  */
 static void insert_list(void* bp, size_t size)
 {
-	int class_idx = 0;										/* Size class index */
+	int class_idx = CLASS_IDX(size);						/* Size class index */
 	void* class_ptr, * current_ptr, * last_ptr = NULL;		/* Size class pointer */
 
-	/* Search list index corresponding to size */
-	while ((size > 1) && (class_idx < MAXCLASS - 1)) {
-		size >>= 1;
-		class_idx ++;
+	class_ptr = CLASS_PTR(class_idx);
+	PUT(BITMAP_PTR, GET(BITMAP_PTR) | (1u << class_idx));	/* Mark the class as non-empty */
+
+	/* Large classes are treaps */
+	if (class_idx >= TREECLASS) {
+		tree_insert(class_ptr, bp);
+		return;
 	}
-	class_ptr = heap_listp + class_idx * WSIZE;
-	current_ptr = (void*)GET(class_ptr);
+	current_ptr = GET_P(class_ptr);
 
-	/* Search insert position */
+	/* Search insert position, keeping the list sorted for best fit (LIFO otherwise) */
+#if FIT_POLICY == FIT_BEST && !CLASS_EXACT
 	while (current_ptr != NULL && (size > GET_SIZE(HDRP(current_ptr)))) {
 		last_ptr = current_ptr;
 		current_ptr = SUCC(current_ptr);
 	}
+#endif
 
 	/* Insert */
 	/* Case 1: insert into mid, last_ptr -> bp -> current_ptr */
@@ -122,36 +472,44 @@ static void insert_list(void* bp, size_t size)
  */
 static void remove_list(void* bp)
 {
-	int class_idx = 0;	/* Size class index */
-	void* class_ptr;	/* Size class pointer */
-	size_t size = GET_SIZE(HDRP(bp));
+	int class_idx = CLASS_IDX(GET_SIZE(HDRP(bp)));	/* Size class index */
+	void* class_ptr = CLASS_PTR(class_idx);			/* Size class pointer */
 
-	/* Search list index corresponding to size */
-	while ((size > 1) && (class_idx < MAXCLASS - 1)) {
-		size >>= 1;
-		class_idx ++;
-	}
-	class_ptr = heap_listp + class_idx * WSIZE;
+	/* Large classes are treaps */
+	if (class_idx >= TREECLASS)
+		tree_remove(class_ptr, bp);
 
 	/* Remove */
 	/* Case 1: remove from mid */
 	/* Case 2: remove from head */
 	/* Case 3: remove from tail */
 	/* Case 4: only one pointer in list */
-	if (PRED(bp) != NULL)
-		PUT_P(SUCC_PTR(PRED(bp)), SUCC(bp));
-	else PUT_P(class_ptr, SUCC(bp));
+	else {
+#if FIT_POLICY == FIT_NEXT
+		if (bp == GET_P(ROVER_PTR(arena_listp)))
+			PUT_P(ROVER_PTR(arena_listp), SUCC(bp));
+#endif
+		if (PRED(bp) != NULL)
+			PUT_P(SUCC_PTR(PRED(bp)), SUCC(bp));
+		else PUT_P(class_ptr, SUCC(bp));
+
+		if (SUCC(bp) != NULL)
+			PUT_P(PRED_PTR(SUCC(bp)), PRED(bp));
+	}
 
-	if (SUCC(bp) != NULL)
-		PUT_P(PRED_PTR(SUCC(bp)), PRED(bp));
+	/* Clear the bitmap bit if the list became empty */
+	if (GET(class_ptr) == 0)
+		PUT(BITMAP_PTR, GET(BITMAP_PTR) & ~(1u << class_idx));
 }
 
 /*
  * coalesce - Coalesce free blocks if they're adjacent. There are 4 cases (in textbook P.596 figure 9-40).
+ *     bp must already carry its free header and footer. The previous block is only
+ *     looked at if the prev-alloc bit says it is free.
  */
 static void* coalesce(void* bp, size_t size)
 {
-	size_t prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
+	size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
 	size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
 
 	if (prev_alloc && next_alloc);				/* Case 1 */
@@ -159,7 +517,7 @@ static void* coalesce(void* bp, size_t size)
 	else if (prev_alloc && !next_alloc) {		/* Case 2 */
 		remove_list(NEXT_BLKP(bp));
 		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-		PUT(HDRP(bp), PACK(size, 0));
+		PUT(HDRP(bp), PACK(size, PREV_ALLOC));
 		PUT(FTRP(bp), PACK(size, 0));
 	}
 
@@ -167,19 +525,21 @@ static void* coalesce(void* bp, size_t size)
 		remove_list(PREV_BLKP(bp));
 		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
 		PUT(FTRP(bp), PACK(size, 0));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
 		bp = PREV_BLKP(bp);
+		PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
 	}
 
 	else {										/* Case 4 */
 		remove_list(PREV_BLKP(bp));
 		remove_list(NEXT_BLKP(bp));
 		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
 		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
 		bp = PREV_BLKP(bp);
+		PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
 	}
 
+	/* The block after a free block is always allocated (or the epilogue) */
+	CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
 	insert_list(bp, size);
 	return bp;
 }
@@ -190,19 +550,53 @@ static void* coalesce(void* bp, size_t size)
 static void* extend_heap(size_t size)
 {
 	void* bp;	/* block pointer */
+	char* zero;	/* first byte of the new memory still zero */
+	char* bp0;
+	int node = NODE(arena_listp);
 
 	/* Allocate an even number of words to maintain alignment */
 	size = ALIGN(size);
-	if ((long)(bp = mem_sbrk(size)) == -1)
-		return NULL;
+	lock(HEAPLOCK_PTR);
+	zero = mem_numa_zero(node);
+
+	/* Grow in place if this arena ends the heap region of its node, or open a new segment */
+	/* there after ALIGNMENT bytes of padding. The zero top goes on in place, and starts over in a new segment. */
+	/* The paddings chain the segments, newest first, for mm_heapstats */
+	if (GET_P(TOP_PTR(arena_listp)) == NODE_BRK(arena_listp) - WSIZE) {
+		if ((long)(bp = mem_numa_sbrk(node, size)) == -1) {
+			unlock(HEAPLOCK_PTR);
+			return NULL;
+		}
+		if (zero <= (char *)bp)
+			zero = GET_P(ZERO_PTR(arena_listp));
+	}
+	else {
+		if ((long)(bp = mem_numa_sbrk(node, size + ALIGNMENT)) == -1) {
+			unlock(HEAPLOCK_PTR);
+			return NULL;
+		}
+		PUT_P(bp, GET_P(SEGS_PTR));
+		PUT_P(SEGS_PTR, bp);
+		bp = (char *)bp + ALIGNMENT;
+		PUT(HDRP(bp), PACK(0, PREV_ALLOC));
+	}
+	PUT_P(ZERO_PTR(arena_listp), zero);
+	heap_extends++;
 
 	/* Initialize free block header/footer and the epilogue header */
-	PUT(HDRP(bp), PACK(size, 0));			/* Free block header */
-	PUT(FTRP(bp), PACK(size, 0));			/* Free block footer */
-	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));	/* New epilogue header */
+	PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));	/* Free block header */
+	PUT(FTRP(bp), PACK(size, 0));							/* Free block footer */
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));					/* New epilogue header */
+	PUT_P(TOP_PTR(arena_listp), HDRP(NEXT_BLKP(bp)));
+	unlock(HEAPLOCK_PTR);
 
-	/* Coalesce if the previous block was free */
-	return coalesce(bp, size);
+	/* Coalesce if the previous block was free, and clear the footer and header in between */
+	bp0 = bp;
+	if ((bp = coalesce(bp, size)) != bp0) {
+		PUT(HDRP(bp0), 0);
+		PUT(HDRP(bp0) - WSIZE, 0);
+	}
+	return bp;
 }
 
 /*
@@ -211,56 +605,222 @@ static void* extend_heap(size_t size)
 static void* place(void *bp, size_t asize)
 {
 	size_t csize = GET_SIZE(HDRP(bp)), remain = csize - asize;
+	size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
 
 	remove_list(bp);
 
 	if (remain < (2 * DSIZE)) {
-		PUT(HDRP(bp), PACK(csize, 1));
-		PUT(FTRP(bp), PACK(csize, 1));
+		PUT(HDRP(bp), PACK(csize, prev_alloc | 1));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
 	}
-	else if(asize < 96) {
-		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(FTRP(bp), PACK(asize, 1));
-		PUT(HDRP(NEXT_BLKP(bp)), PACK(remain, 0));
+	else if(asize < PLACE_SPLIT) {
+		PUT(HDRP(bp), PACK(asize, prev_alloc | 1));
+		PUT(HDRP(NEXT_BLKP(bp)), PACK(remain, PREV_ALLOC));
 		PUT(FTRP(NEXT_BLKP(bp)), PACK(remain, 0));
 		insert_list(NEXT_BLKP(bp), remain);
 	}
 	else {
-		PUT(HDRP(bp), PACK(remain, 0));
+		PUT(HDRP(bp), PACK(remain, prev_alloc));
 		PUT(FTRP(bp), PACK(remain, 0));
 		insert_list(bp, remain);
 		bp = NEXT_BLKP(bp);
 		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(FTRP(bp), PACK(asize, 1));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+	}
+	SET_DIRTY(NEXT_BLKP(bp));
+	return bp;
+}
+
+#if FIT_POLICY == FIT_NEXT
+/*
+ * next_fit - Find the first block of at least asize bytes in the list of class class_idx,
+ *     which starts at head, from the rover of the current arena on, wrapping around.
+ */
+static void* next_fit(void* head, int class_idx, size_t asize)
+{
+	char* rover = GET_P(ROVER_PTR(arena_listp));
+	char* bp;
+
+	/* The rover only counts in its own class */
+	if (rover == NULL || CLASS_IDX(GET_SIZE(HDRP(rover))) != class_idx)
+		rover = head;
+
+	bp = rover;
+	while (bp != NULL && GET_SIZE(HDRP(bp)) < asize)
+		bp = SUCC(bp);
+	if (bp == NULL && rover != head) {
+		bp = head;
+		while (bp != rover && GET_SIZE(HDRP(bp)) < asize)
+			bp = SUCC(bp);
+		if (bp == rover)
+			bp = NULL;
 	}
+
+	if (bp != NULL)
+		PUT_P(ROVER_PTR(arena_listp), bp);
 	return bp;
 }
+#endif
 
 /*
  * find_fit - Find a block in the segregated free list with fit size.
- *     Implement segregated fit.
+ *     Implement segregated fit. Only the non-empty classes marked in the bitmap
+ *     are visited, starting from the class of asize.
  */
 static void* find_fit(size_t asize)
 {
-	int class_idx = 0;
-	void* bp = NULL;
-	size_t size = asize;
+	int class_idx = CLASS_IDX(asize);
+	unsigned int mask = GET(BITMAP_PTR) & (~0u << class_idx);	/* Usable classes */
+	void* bp;
+
+	/* First-fit search in lists (best fit when sorted), best-fit search in treaps */
+	while (mask != 0) {
+		class_idx = __builtin_ctz(mask);
+		bp = GET_P(CLASS_PTR(class_idx));
 
-	/* First-fit search */
-	while (class_idx < MAXCLASS) {
-		/* Search list index corresponding to size */
-		if ((size <= 1) && ((bp = (void*)GET(heap_listp + class_idx * WSIZE)) != NULL)) {
-			/* Search appropriate size */
+		if (class_idx >= TREECLASS)
+			bp = tree_fit(bp, asize);
+		else {
+#if FIT_POLICY == FIT_NEXT
+			bp = next_fit(bp, class_idx, asize);
+#else
 			while ((bp != NULL) && (asize > GET_SIZE(HDRP(bp))))
 				bp = SUCC(bp);
-			if (bp != NULL)
-				break;
+#endif
 		}
+		if (bp != NULL)
+			return bp;
 
-		size >>= 1;
-		class_idx++;
+		mask &= mask - 1;
 	}
-	return bp;
+	return NULL;
+}
+
+/*
+ * init_arena - Initialize the segregated list, its bitmap and the slab run lists of arena,
+ *     which grows in the heap region of node. The arena has no segment of the heap yet.
+ */
+static void init_arena(void* arena, int node)
+{
+	int i;
+
+	for (i = 0; i < MAXCLASS; i++)
+		PUT_P((char *)arena + i * WSIZE, NULL);
+	PUT((char *)arena + MAXCLASS * WSIZE, 0);
+	for (i = 0; i < NSLAB; i++)
+		PUT_P((char *)arena + (MAXCLASS + 1 + i) * WSIZE, NULL);
+	PUT(LOCK_PTR(arena), 0);
+	PUT_P(TOP_PTR(arena), NULL);
+	PUT_P(NEXT_ARENA(arena), NULL);
+	PUT(SHARED_PTR(arena), ARENA_OWNED);
+	PUT_P(REMOTE_PTR(arena), NULL);
+	PUT(GROW_PTR(arena), CHUNKSIZE);
+	PUT_P(ZERO_PTR(arena), NULL);
+	PUT_P(ROVER_PTR(arena), NULL);
+	PUT(NODE_PTR(arena), node);
+	for (i = 0; i < NQUICK; i++)
+		PUT_P((char *)arena + (MAXCLASS + 10 + NSLAB + i) * WSIZE, NULL);
+}
+
+/*
+ * shared_arena - Return the arena shared by the threads of node beyond MAXARENA - 1, if there
+ *     is one yet. The caller holds the heap lock.
+ */
+static void* shared_arena(int node)
+{
+	void* arena;
+
+	for (arena = heap_listp; arena != NULL; arena = GET_P(NEXT_ARENA(arena)))
+		if (GET(SHARED_PTR(arena)) == ARENA_SHARED && NODE(arena) == node)
+			return arena;
+	return NULL;
+}
+
+/*
+ * adopt_arena - Claim an orphaned arena of node for the calling thread, if there is one.
+ *     The caller holds the heap lock, and waits on the arena lock once it has released it.
+ */
+static void* adopt_arena(int node)
+{
+	void* arena;
+
+	for (arena = heap_listp; arena != NULL; arena = GET_P(NEXT_ARENA(arena)))
+		if (NODE(arena) == node && __sync_bool_compare_and_swap((unsigned int *)SHARED_PTR(arena),
+				ARENA_ORPHAN, ARENA_OWNED))
+			return arena;
+	return NULL;
+}
+
+/*
+ * new_arena - Carve a new arena for node out of the heap and link it after the main arena,
+ *     which sits at heap_listp. The arena grows segments of the heap of its own, each
+ *     closed by its own epilogue. The caller holds the heap lock. Return NULL if out of memory.
+ */
+static void* new_arena(int node)
+{
+	void* arena;
+
+	if ((arena = mem_numa_sbrk(node, ALIGN(ARENAWORDS * WSIZE))) == (void*)-1)
+		return NULL;
+	init_arena(arena, node);
+	PUT_P(NEXT_ARENA(arena), GET_P(NEXT_ARENA(heap_listp)));
+	PUT_P(NEXT_ARENA(heap_listp), arena);
+	return arena;
+}
+
+static void leave_thread(void* arena);
+
+/*
+ * make_arena_key - Create the key that calls leave_thread when a thread with an arena exits.
+ */
+static void make_arena_key(void)
+{
+	pthread_key_create(&arena_key, leave_thread);
+}
+
+/*
+ * get_arena - Return the arena of the calling thread, NULL if out of memory. A thread
+ *     without one adopts an arena of the node it runs on left by an exited thread. Else
+ *     it gets an arena of its own there while there are fewer than MAXARENA - 1, and the
+ *     arena of that node shared under its lock afterwards. An arena grows in the heap
+ *     region of its node, each node having a region of its own with VM_NUMA (config.h).
+ */
+static void* get_arena(void)
+{
+	void* arena;
+	int node, adopted;
+
+	if (thread_arena != NULL && arena_gen == heap_gen)
+		return thread_arena;
+
+	pthread_once(&arena_key_once, make_arena_key);
+	node = mem_numa_node();
+	lock(HEAPLOCK_PTR);
+	if ((adopted = ((arena = adopt_arena(node)) != NULL)))
+		;
+	else if (GET(NARENAS_PTR) < MAXARENA - 1 || (arena = shared_arena(node)) == NULL) {
+		if ((arena = new_arena(node)) == NULL) {
+			unlock(HEAPLOCK_PTR);
+			return NULL;
+		}
+		if (GET(NARENAS_PTR) < MAXARENA - 1)
+			PUT(NARENAS_PTR, GET(NARENAS_PTR) + 1);
+		else
+			PUT(SHARED_PTR(arena), ARENA_SHARED);
+	}
+	unlock(HEAPLOCK_PTR);
+
+	/* Let a thread still freeing into the orphan directly finish first */
+	if (adopted) {
+		lock(LOCK_PTR(arena));
+		unlock(LOCK_PTR(arena));
+	}
+
+	thread_arena = arena;
+	arena_gen = heap_gen;
+	if (GET(SHARED_PTR(arena)) == ARENA_OWNED)
+		pthread_setspecific(arena_key, arena);
+	return arena;
 }
 
 /* 
@@ -268,109 +828,1385 @@ static void* find_fit(size_t asize)
  */
 int mm_init(void)
 {
-	int i;
 	/* Create the initial empty heap */
-	if ((heap_listp = mem_sbrk((3 + MAXCLASS) * WSIZE)) == (void*)-1)
+	if ((heap_listp = mem_sbrk((3 + LISTWORDS) * WSIZE)) == (void*)-1)
 		return -1;
+	heap_base = (char *)heap_listp - DSIZE;
 
-	/* Initialize segregated list */
-	for (i = 0; i < MAXCLASS; i++)
-		PUT_P(heap_listp + (i * WSIZE), NULL);
+	/* The calling thread works on the main arena */
+	arena_listp = thread_arena = heap_listp;
+	arena_gen = ++heap_gen;
+	heap_extends = 0;
+
+	/* Initialize the main arena, which grows on the node of the calling thread, */
+	/* the page map and the heap-wide words */
+	init_arena(heap_listp, mem_numa_node());
+	PUT_P(PAGEMAP_PTR, NULL);
+	PUT(PAGEMAP_LEN, 0);
+	PUT(HEAPLOCK_PTR, 0);
+	PUT(NARENAS_PTR, 1);
+	PUT_P(SEGS_PTR, NULL);
+	PUT(NBOUND_PTR, 0);
 
-	PUT(heap_listp + (MAXCLASS * WSIZE), PACK(DSIZE, 1));		/* Prologue header */
-	PUT(heap_listp + ((1 + MAXCLASS) * WSIZE), PACK(DSIZE, 1));	/* Prologue footer */
-	PUT(heap_listp + ((2 + MAXCLASS) * WSIZE), PACK(0, 1));		/* Epilogue header */
+	PUT(heap_listp + (LISTWORDS * WSIZE), PACK(DSIZE, 1));				/* Prologue header */
+	PUT(heap_listp + ((1 + LISTWORDS) * WSIZE), PACK(DSIZE, 1));		/* Prologue footer */
+	PUT(heap_listp + ((2 + LISTWORDS) * WSIZE), PACK(0, PREV_ALLOC | 1));	/* Epilogue header */
+	PUT_P(TOP_PTR(heap_listp), heap_listp + ((2 + LISTWORDS) * WSIZE));
+	PUT_P(ZERO_PTR(heap_listp), heap_listp + ((2 + LISTWORDS) * WSIZE));
 
 	/* Extend the empty heap with a free block of CHUNKSIZE bytes */
 	if (extend_heap(CHUNKSIZE) == NULL)
 		return -1;
+
+	/* Let the main arena be orphaned and adopted like any other when this thread exits */
+	pthread_once(&arena_key_once, make_arena_key);
+	pthread_setspecific(arena_key, heap_listp);
     return 0;
 }
 
-/* 
- * mm_malloc - Allocate a block by finding a fit block. If no fit block, extend the heap.
- *     Always allocate a block whose size is a multiple of the alignment.
+/*
+ * trim_heap - Shrink the heap under free block bp, which is followed by an epilogue,
+ *     if it ends the heap region of its node. Keep CHUNKSIZE bytes of it for the next requests.
  */
-void *mm_malloc(size_t size)
+static void trim_heap(void* bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	size_t release = (size - CHUNKSIZE) & ~(CHUNKSIZE - 1);
+
+	lock(HEAPLOCK_PTR);
+	if (GET_P(TOP_PTR(arena_listp)) == HDRP(NEXT_BLKP(bp)) &&
+			HDRP(NEXT_BLKP(bp)) == NODE_BRK(arena_listp) - WSIZE &&
+			mem_numa_sbrk(NODE(arena_listp), -(int)release) != (void*)-1) {
+		remove_list(bp);
+		size -= release;
+		PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+		PUT(FTRP(bp), PACK(size, 0));
+		PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));					/* New epilogue header */
+		PUT_P(TOP_PTR(arena_listp), HDRP(NEXT_BLKP(bp)));
+		insert_list(bp, size);
+		if (GET_P(ZERO_PTR(arena_listp)) > HDRP(NEXT_BLKP(bp)))
+			PUT_P(ZERO_PTR(arena_listp), HDRP(NEXT_BLKP(bp)));
+
+		/* The peak is over: start growing from CHUNKSIZE again */
+		PUT(GROW_PTR(arena_listp), CHUNKSIZE);
+	}
+	unlock(HEAPLOCK_PTR);
+}
+
+/*
+ * free_block - Freeing a block by setting its head and tail mark, then do coalesce if possible.
+ */
+static void free_block(void* bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+
+	PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+	PUT(FTRP(bp), PACK(size, 0));
+	bp = coalesce(bp, size);
+
+	/* Give a large free block at the top of the heap back */
+	if (GET_SIZE(HDRP(bp)) >= TRIM_THRESHOLD && GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+		trim_heap(bp);
+}
+
+/*
+ * grow_heap - Extend the heap for a request of size bytes by the growth chunk of the
+ *     current arena at least, and double the chunk, up to MAXCHUNK and to 1/2^CHUNKSHIFT
+ *     of the heap. The slack beyond size is cut so that the heap ends on a multiple of
+ *     GROWALIGN when it can.
+ */
+static void* grow_heap(size_t size)
+{
+	size_t chunk = GET(GROW_PTR(arena_listp));
+	char* brk = NODE_BRK(arena_listp);
+	char* end = GROW_FLOOR(brk + MAX(size, chunk));
+	void* bp;
+
+	if ((bp = extend_heap(end >= brk + size ? (size_t)(end - brk) : MAX(size, chunk))) != NULL)
+		PUT(GROW_PTR(arena_listp), MIN(2 * chunk, MAX(CHUNKSIZE, MIN(MAXCHUNK, mem_heapsize() >> CHUNKSHIFT))));
+	return bp;
+}
+
+/*
+ * consolidate - Free and coalesce every block waiting in the quick lists of the current
+ *     arena, on a miss of find_fit before the heap is extended. Return whether there was any.
+ */
+static int consolidate(void)
 {
-	size_t asize;		/* Adjusted block size */
-	size_t extendsize;	/* Amount to extend heap if no fit */
+	int i, found = 0;
 	char* bp;
 
-	/* Ignore spurious request */
-	if (size == 0)
-		return NULL;
+	for (i = 0; i < NQUICK; i++) {
+		while ((bp = GET_P(QUICK_PTR(i))) != NULL) {
+			PUT_P(QUICK_PTR(i), GET_P(bp));
+			free_block(bp);
+			found = 1;
+		}
+	}
+	return found;
+}
 
-	/* Adjust block size to include overhead and alignment requsts */
-	if (size <= DSIZE)
-		asize = 2 * DSIZE;
-	else
-		asize = ALIGN(size + DSIZE);
+/*
+ * alloc_block - Allocate a block of asize bytes by finding a fit block. If no fit block, extend the heap.
+ */
+static void* alloc_block(size_t asize)
+{
+	char* bp;
 
-	/* Search the free list for a fit */
-	if ((bp = find_fit(asize)) != NULL)
+	/* Search the free list for a fit, again after merging the quick lists */
+	if ((bp = find_fit(asize)) != NULL || (consolidate() && (bp = find_fit(asize)) != NULL))
 		return place(bp, asize);
 
 	/* No fit block found. Get more memory and place the block */
-	extendsize = MAX(asize, CHUNKSIZE);
-	if ((bp = extend_heap(extendsize)) == NULL)
+	if ((bp = grow_heap(asize)) == NULL)
 		return NULL;
 	return place(bp, asize);
 }
 
 /*
- * mm_free - Freeing a block by setting its head and tail mark, then do coalesce if possible.
+ * place_batch - Cut n blocks of asize bytes from the start of free block bp, which holds
+ *     them all, into out with a single list removal. The rest is split off as one free block.
  */
-void mm_free(void *bp)
+static void place_batch(void* bp, size_t asize, size_t n, void** out)
 {
-	size_t size = GET_SIZE(HDRP(bp));
+	size_t remain = GET_SIZE(HDRP(bp)) - n * asize;
+	size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+	size_t i;
 
-	PUT(HDRP(bp), PACK(size, 0));
-	PUT(FTRP(bp), PACK(size, 0));
-	coalesce(bp, size);
+	remove_list(bp);
+	for (i = 0; i < n; i++) {
+		PUT(HDRP(bp), PACK(asize, prev_alloc | 1));
+		out[i] = bp;
+		bp = (char *)bp + asize;
+		prev_alloc = PREV_ALLOC;
+	}
+
+	/* The last block takes a rest too small for a free block */
+	if (remain < 2 * DSIZE) {
+		PUT(HDRP(out[n - 1]), GET(HDRP(out[n - 1])) + remain);
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(out[n - 1])));
+	}
+	else {
+		PUT(HDRP(bp), PACK(remain, PREV_ALLOC));
+		PUT(FTRP(bp), PACK(remain, 0));
+		insert_list(bp, remain);
+	}
+	SET_DIRTY(NEXT_BLKP(out[n - 1]));
 }
 
 /*
- * mm_realloc - Examine if nearest block is free. Coalesce them if the sum of their sizes
- *     is enough for realloc, extend heap otherwise.
+ * aligned_lead - Bytes to skip from bp to a payload aligned to align bytes, leaving room
+ *     for a free block in front.
  */
-void* mm_realloc(void* ptr, size_t size)
+static size_t aligned_lead(void* bp, size_t align)
 {
-	void* newptr = ptr;
-	int remain;
+	size_t lead = (align - (unsigned long)bp % align) % align;
 
-	if (size == 0)
-		return NULL;
+	if (lead != 0 && lead < 2 * DSIZE)
+		lead += align;
+	return lead;
+}
 
-	/* Align */
-	if (size <= DSIZE)
-		size = 2 * DSIZE;
-	else
-		size = ALIGN(size + DSIZE);
+/*
+ * place_aligned - Place asize into bp with the payload aligned to align bytes. The leading
+ *     slack is split off and given back to the free lists, and so is the tail.
+ */
+static void* place_aligned(void* bp, size_t asize, size_t align)
+{
+	size_t csize = GET_SIZE(HDRP(bp));
+	size_t lead = aligned_lead(bp, align);
+	size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
 
-	/* New size < origin size, do nothing */
-	if ((remain = GET_SIZE(HDRP(ptr)) - size) >= 0)
-		return newptr;
+	remove_list(bp);
 
-	/* Examine nearest block */
-	if (!GET_ALLOC(HDRP(NEXT_BLKP(ptr))) || !GET_SIZE(HDRP(NEXT_BLKP(ptr)))) {
-		/* Not enough and need extend */
-		if ((remain = GET_SIZE(HDRP(ptr)) + GET_SIZE(HDRP(NEXT_BLKP(ptr))) - size) < 0) {
-			if (extend_heap(MAX(-remain, CHUNKSIZE)) == NULL)
-				return NULL;
-			remain += MAX(-remain, CHUNKSIZE);
-		}
-		/* Remove next block */
-		remove_list(NEXT_BLKP(ptr));
-		PUT(HDRP(ptr), PACK(size + remain, 1));
-		PUT(FTRP(ptr), PACK(size + remain, 1));
+	if (lead != 0) {
+		PUT(HDRP(bp), PACK(lead, prev_alloc));
+		PUT(FTRP(bp), PACK(lead, 0));
+		insert_list(bp, lead);
+		bp = (char *)bp + lead;
+		csize -= lead;
+		prev_alloc = 0;
+	}
+
+	if (csize - asize < 2 * DSIZE) {
+		PUT(HDRP(bp), PACK(csize, prev_alloc | 1));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
 	}
-	/* No proper free block */
 	else {
-		newptr = mm_malloc(size);
-		memcpy(newptr, ptr, GET_SIZE(HDRP(ptr)));
-		mm_free(ptr);
+		PUT(HDRP(bp), PACK(asize, prev_alloc | 1));
+		PUT(HDRP(NEXT_BLKP(bp)), PACK(csize - asize, PREV_ALLOC));
+		PUT(FTRP(NEXT_BLKP(bp)), PACK(csize - asize, 0));
+		insert_list(NEXT_BLKP(bp), csize - asize);
 	}
+	SET_DIRTY(NEXT_BLKP(bp));
+	return bp;
+}
 
-	return newptr;
+/*
+ * alloc_aligned - Allocate a block of asize bytes whose payload is aligned to align bytes.
+ */
+static void* alloc_aligned(size_t asize, size_t align)
+{
+	char* brk = NODE_BRK(arena_listp);		/* Payload of the next in-place extension */
+	size_t fitsize = asize + align + 2 * DSIZE;	/* Enough for any leading slack */
+	char* bp;
+
+	/* Search the free list for a fit with room for any leading slack */
+	if ((bp = find_fit(fitsize)) != NULL || (consolidate() && (bp = find_fit(fitsize)) != NULL))
+		return place_aligned(bp, asize, align);
+
+	/* No fit block found. Extend the heap just past the next aligned payload, which */
+	/* another arena may have moved meanwhile */
+	if (GET_P(TOP_PTR(arena_listp)) != brk - WSIZE)
+		brk += ALIGNMENT;
+	if ((bp = extend_heap(aligned_lead(brk, align) + asize)) == NULL)
+		return NULL;
+	if (GET_SIZE(HDRP(bp)) < aligned_lead(bp, align) + asize && (bp = extend_heap(fitsize)) == NULL)
+		return NULL;
+	return place_aligned(bp, asize, align);
+}
+
+/*
+ * page_tag - Return the page map tag of the page holding p. The map keeps a byte per
+ *     heap page, so that mm_free tells slab slots, which bypass coalesce, from blocks.
+ */
+static int page_tag(void* p)
+{
+	size_t idx = PAGE_IDX(p);
+	unsigned int map;
+
+	/* Lock-free: the length is published after the map it refers to */
+	if (idx >= __atomic_load_n((unsigned int *)PAGEMAP_LEN, __ATOMIC_ACQUIRE))
+		return 0;
+	map = __atomic_load_n((unsigned int *)PAGEMAP_PTR, __ATOMIC_ACQUIRE);
+	return ((unsigned char *)OFF_PTR(map))[idx];
+}
+
+/*
+ * set_page_tag - Tag the page holding p, growing the page map if it does not cover it yet.
+ *     The new map comes from the current arena; old maps are never freed, because
+ *     page_tag may still be reading them without a lock. Return -1 if the page map cannot grow.
+ */
+static int set_page_tag(void* p, int tag)
+{
+	size_t idx = PAGE_IDX(p), len = GET(PAGEMAP_LEN);
+	unsigned char* newmap = NULL;
+	void* oldmap;
+	size_t newlen = MAX(MAX(idx + 1, 2 * len), SLABLIMIT);	/* Never small enough for a run */
+
+	if (idx >= len && (newmap = alloc_block(ASIZE(newlen))) == NULL)
+		return -1;
+
+	lock(HEAPLOCK_PTR);
+	len = GET(PAGEMAP_LEN);
+	if (newmap != NULL && idx < len) {
+		/* Another arena grew the map meanwhile */
+		free_block(newmap);
+	}
+	else if (newmap != NULL) {
+		if ((oldmap = GET_P(PAGEMAP_PTR)) != NULL)
+			memcpy(newmap, oldmap, len);
+		memset(newmap + len, 0, newlen - len);
+		__atomic_store_n((unsigned int *)PAGEMAP_PTR, PTR_OFF(newmap), __ATOMIC_RELEASE);
+		__atomic_store_n((unsigned int *)PAGEMAP_LEN, newlen, __ATOMIC_RELEASE);
+	}
+	((unsigned char *)GET_P(PAGEMAP_PTR))[idx] = tag;
+	unlock(HEAPLOCK_PTR);
+	return 0;
+}
+
+/*
+ * run_new - Carve a new run of slot size index idx out of the heap and push it on its partial list.
+ *     A run is a page-aligned block of RUNSIZE bytes cut into same-size slots with no
+ *     boundary tags, the free ones marked in a bitmap in the run header.
+ */
+static void* run_new(int idx)
+{
+	size_t slotsize = (idx + 1) * DSIZE;
+	size_t nslots = (RUNSIZE - WSIZE - RUN_HDR) / slotsize;
+	void* run;
+	int i;
+
+	/* The block is exactly RUNSIZE: its header ends the page before, and the last word */
+	/* of the page is the header of the next block, so that runs pack one per page */
+	if ((run = alloc_aligned(RUNSIZE, RUNSIZE)) == NULL)
+		return NULL;
+	if (set_page_tag(run, PAGE_SLAB) < 0) {
+		free_block(run);
+		return NULL;
+	}
+
+	PUT(RUN_SLOTSIZE(run), slotsize);
+	PUT(RUN_NSLOTS(run), nslots);
+	PUT(RUN_NFREE(run), nslots);
+	for (i = 0; i < RUN_MAPWORDS; i++, nslots -= MIN(nslots, 32))
+		PUT(RUN_MAP(run, i), nslots >= 32 ? ~0u : (1u << nslots) - 1);
+
+	PUT_P(RUN_ARENA(run), arena_listp);
+	PUT_P(RUN_PREV(run), NULL);
+	PUT_P(RUN_NEXT(run), NULL);
+	PUT_P(SLAB_PTR(idx), run);
+	return run;
+}
+
+/*
+ * run_unlink - Remove run from the partial run list of slot size index idx.
+ */
+static void run_unlink(void* run, int idx)
+{
+	void* prev = GET_P(RUN_PREV(run));
+	void* next = GET_P(RUN_NEXT(run));
+
+	if (prev != NULL)
+		PUT_P(RUN_NEXT(prev), next);
+	else
+		PUT_P(SLAB_PTR(idx), next);
+	if (next != NULL)
+		PUT_P(RUN_PREV(next), prev);
+}
+
+/*
+ * slab_alloc - Take a free slot from the first partial run of the slot size for size.
+ */
+static void* slab_alloc(size_t size)
+{
+	int idx = SLAB_IDX(size), i = 0, bit;
+	void* run = GET_P(SLAB_PTR(idx));
+	unsigned int map;
+
+	if (run == NULL && (run = run_new(idx)) == NULL)
+		return NULL;
+
+	/* Partial runs always have a free slot */
+	while ((map = GET(RUN_MAP(run, i))) == 0)
+		i++;
+	bit = __builtin_ctz(map);
+	PUT(RUN_MAP(run, i), map & (map - 1));
+
+	/* Full runs leave the partial list */
+	PUT(RUN_NFREE(run), GET(RUN_NFREE(run)) - 1);
+	if (GET(RUN_NFREE(run)) == 0)
+		run_unlink(run, idx);
+
+	return (char *)run + RUN_HDR + (i * 32 + bit) * GET(RUN_SLOTSIZE(run));
+}
+
+/*
+ * slab_free - Give slot bp back to its run. A run that becomes empty is returned to
+ *     the heap unless it is the only partial run of its slot size.
+ */
+static void slab_free(void* bp)
+{
+	char* run = RUNP(bp);
+	int idx = SLAB_IDX(GET(RUN_SLOTSIZE(run)));
+	size_t slot = ((char *)bp - run - RUN_HDR) / GET(RUN_SLOTSIZE(run));
+	size_t nfree = GET(RUN_NFREE(run));
+
+	PUT(RUN_MAP(run, slot / 32), GET(RUN_MAP(run, slot / 32)) | (1u << (slot % 32)));
+	PUT(RUN_NFREE(run), nfree + 1);
+
+	/* A full run becomes partial again */
+	if (nfree == 0) {
+		PUT_P(RUN_PREV(run), NULL);
+		PUT_P(RUN_NEXT(run), GET_P(SLAB_PTR(idx)));
+		if (GET(SLAB_PTR(idx)) != 0)
+			PUT_P(RUN_PREV(GET_P(SLAB_PTR(idx))), run);
+		PUT_P(SLAB_PTR(idx), run);
+	}
+	else if (nfree + 1 == GET(RUN_NSLOTS(run)) &&
+			(GET(RUN_PREV(run)) != 0 || GET(RUN_NEXT(run)) != 0)) {
+		run_unlink(run, idx);
+		set_page_tag(run, 0);
+		free_block(run);
+	}
+}
+
+/*
+ * map_block - Map a block of its own for a huge request, its payload aligned to align
+ *     bytes. The mapping starts on the page of the payload less MAP_PAD, and its length,
+ *     a size_t, sits right before the payload, so a mapping of any size is described.
+ */
+static void* map_block(size_t size, size_t align)
+{
+	size_t pagesize = mem_pagesize();
+	size_t slack = align > ALIGNMENT ? align : 0;	/* Room to slide the payload to align */
+	size_t len;
+	char *p, *bp, *lo, *hi;
+
+	/* Lengths that would wrap around fail */
+	if (size > (size_t)-1 - MAP_PAD - slack - pagesize)
+		return NULL;
+	len = (size + MAP_PAD + slack + pagesize - 1) & ~(pagesize - 1);
+	lock(HEAPLOCK_PTR);
+	if ((p = mem_map(len)) == (void*)-1) {
+		unlock(HEAPLOCK_PTR);
+		return NULL;
+	}
+
+	/* Give back the pages an aligned payload leaves unused on either side */
+	bp = (char *)(((unsigned long)p + MAP_PAD + align - 1) & ~(unsigned long)(align - 1));
+	lo = MAP_BASE(bp);
+	hi = (char *)(((unsigned long)bp + size + pagesize - 1) & ~(unsigned long)(pagesize - 1));
+	if (lo != p || hi != p + len)
+		mem_shrink(p, lo, hi - lo);
+	unlock(HEAPLOCK_PTR);
+
+	MAP_LEN(bp) = hi - lo;
+	return bp;
+}
+
+/*
+ * unmap_block - Unmap a block of map_block when it is freed.
+ */
+static void unmap_block(void* bp)
+{
+	lock(HEAPLOCK_PTR);
+	mem_unmap(MAP_BASE(bp));
+	unlock(HEAPLOCK_PTR);
+}
+
+/*
+ * trim_block - Unmap the pages of mapped block bp past the first size bytes of its payload.
+ */
+static void trim_block(void* bp, size_t size)
+{
+	size_t pagesize = mem_pagesize();
+	char* lo = MAP_BASE(bp);
+	char* hi = (char *)(((unsigned long)bp + size + pagesize - 1) & ~(unsigned long)(pagesize - 1));
+
+	if (hi == lo + MAP_LEN(bp))
+		return;
+	lock(HEAPLOCK_PTR);
+	mem_shrink(lo, lo, hi - lo);
+	unlock(HEAPLOCK_PTR);
+	MAP_LEN(bp) = hi - lo;
+}
+
+/*
+ * set_foreign - Mark block bp as allocated in the current arena, which is not the main one.
+ */
+static void set_foreign(void* bp)
+{
+	PUT(HDRP(bp), GET(HDRP(bp)) | FOREIGN);
+	PUT_P(FTRP(bp), arena_listp);
+}
+
+/*
+ * block_arena - Return the arena owning allocated block bp; tell if it is a slab slot.
+ *     Slots find it in their run header, and blocks of the arenas other than the main
+ *     one in the owner word of their footer slot.
+ */
+static void* block_arena(void* bp, int* slab)
+{
+	if ((*slab = (page_tag(bp) == PAGE_SLAB)))
+		return GET_P(RUN_ARENA(RUNP(bp)));
+	if (GET_FOREIGN(HDRP(bp)))
+		return GET_P(FTRP(bp));
+	return heap_listp;
+}
+
+/*
+ * malloc_arena - Allocate a slab slot for small requests, or a block by finding a fit
+ *     block in the current arena.
+ */
+static void* malloc_arena(size_t size)
+{
+	size_t asize;
+	char* bp;
+
+	/* Small requests come from slab runs first */
+	if (size < SLABLIMIT && (bp = slab_alloc(size)) != NULL)
+		return bp;
+
+	/* Adjust block size to include overhead and alignment requsts */
+	asize = ARENA_ASIZE(size);
+
+	/* A block of this very size in the quick lists is ready for use */
+	if (IS_QUICK(asize) && (bp = GET_P(QUICK_PTR(QUICK_IDX(asize)))) != NULL) {
+		PUT_P(QUICK_PTR(QUICK_IDX(asize)), GET_P(bp));
+		return bp;
+	}
+
+	if ((bp = alloc_block(asize)) != NULL && arena_listp != heap_listp)
+		set_foreign(bp);
+	return bp;
+}
+
+/*
+ * malloc_batch - Allocate n blocks of size bytes in the current arena into out; return
+ *     how many. Small requests take slab slots and blocks in the quick list go first,
+ *     the others are carved a free block at a time, with a single removal each.
+ */
+static size_t malloc_batch(size_t size, size_t n, void** out)
+{
+	size_t asize = ARENA_ASIZE(size), i = 0, k;
+	char* bp;
+
+	if (size < SLABLIMIT) {
+		while (i < n && (out[i] = malloc_arena(size)) != NULL)
+			i++;
+		return i;
+	}
+
+	if (IS_QUICK(asize)) {
+		while (i < n && (bp = GET_P(QUICK_PTR(QUICK_IDX(asize)))) != NULL) {
+			PUT_P(QUICK_PTR(QUICK_IDX(asize)), GET_P(bp));
+			out[i++] = bp;
+		}
+	}
+
+	/* The others are cut from one free block per MMAP_THRESHOLD bytes, found or grown */
+	while (i < n) {
+		k = MIN(n - i, MAX(MMAP_THRESHOLD / asize, 1));
+		if ((bp = find_fit(k * asize)) == NULL &&
+				(!consolidate() || (bp = find_fit(k * asize)) == NULL) &&
+				(bp = grow_heap(k * asize)) == NULL)
+			break;
+		place_batch(bp, asize, k, out + i);
+		for (; k > 0; k--, i++)
+			if (arena_listp != heap_listp)
+				set_foreign(out[i]);
+	}
+
+	/* Short of memory for that many: one block at a time */
+	for (; i < n && (out[i] = alloc_block(asize)) != NULL; i++)
+		if (arena_listp != heap_listp)
+			set_foreign(out[i]);
+	return i;
+}
+
+/*
+ * free_arena - Give a slab slot back to its run. Push a block of a quick list size onto
+ *     its LIFO list, still marked allocated and ready for the next request of that size,
+ *     and free and coalesce any other block.
+ */
+static void free_arena(void* bp, int slab)
+{
+	size_t size;
+
+	if (slab)
+		slab_free(bp);
+	else if (IS_QUICK(size = GET_SIZE(HDRP(bp)))) {
+		PUT_P(bp, GET_P(QUICK_PTR(QUICK_IDX(size))));
+		PUT_P(QUICK_PTR(QUICK_IDX(size)), bp);
+	}
+	else
+		free_block(bp);
+}
+
+/*
+ * own_arena - Tell if arena is the calling thread's arena, without creating one.
+ */
+static int own_arena(void* arena)
+{
+	return arena == thread_arena && arena_gen == heap_gen;
+}
+
+/*
+ * enter_arena - Make arena current, taking its lock if it is shared or bound to no thread.
+ *     An arena owned by one thread is only ever touched by that thread, without locking:
+ *     other threads hand their frees to its remote free queue, which mm_malloc drains.
+ */
+static void enter_arena(void* arena)
+{
+	if (ARENA_LOCKED(arena))
+		lock(LOCK_PTR(arena));
+	arena_listp = arena;
+}
+
+/*
+ * leave_arena - Release arena after enter_arena.
+ */
+static void leave_arena(void* arena)
+{
+	if (ARENA_LOCKED(arena))
+		unlock(LOCK_PTR(arena));
+}
+
+/*
+ * drain_remote - Take the whole remote free queue of the current arena at once and free
+ *     its blocks.
+ */
+static void drain_remote(void)
+{
+	unsigned int head;
+	char* bp;
+	char* next;
+
+	/* A plain load keeps the common empty case free of atomic read-modify-writes */
+	if (__atomic_load_n((unsigned int *)REMOTE_PTR(arena_listp), __ATOMIC_RELAXED) == 0)
+		return;
+
+	head = __atomic_exchange_n((unsigned int *)REMOTE_PTR(arena_listp), 0, __ATOMIC_ACQUIRE);
+	for (bp = OFF_PTR(head); bp != NULL; bp = next) {
+		next = GET_P(bp);
+		free_arena(bp, page_tag(bp) == PAGE_SLAB);
+	}
+}
+
+/*
+ * remote_free - Push bp onto the remote free queue of arena, which the calling thread
+ *     does not own. The queue is a lock-free stack linked through the first payload word.
+ *     An orphaned arena is freed into directly instead, until a thread adopts it, and so
+ *     is an arena of mm_arena_create, which no thread drains.
+ */
+static void remote_free(void* arena, void* bp)
+{
+	void* saved = arena_listp;
+	unsigned int head, state;
+
+	/* An orphaned or bound arena takes the free at once, under its lock, with the queue */
+	if ((state = ARENA_STATE(arena)) == ARENA_ORPHAN || state == ARENA_BOUND) {
+		lock(LOCK_PTR(arena));
+		if (ARENA_STATE(arena) == state) {
+			arena_listp = arena;
+			drain_remote();
+			free_arena(bp, page_tag(bp) == PAGE_SLAB);
+			unlock(LOCK_PTR(arena));
+			arena_listp = saved;
+			return;
+		}
+		unlock(LOCK_PTR(arena));
+	}
+
+	do {
+		head = __atomic_load_n((unsigned int *)REMOTE_PTR(arena), __ATOMIC_RELAXED);
+		PUT(bp, head);
+	} while (!__sync_bool_compare_and_swap((unsigned int *)REMOTE_PTR(arena), head, PTR_OFF(bp)));
+}
+
+/*
+ * leave_thread - Destructor of arena_key: drain the remote free queue and the quick lists
+ *     of the arena of an exiting thread, and leave it orphaned, for another thread to
+ *     adopt and the others to free into in the meantime.
+ */
+static void leave_thread(void* arena)
+{
+	if (arena != thread_arena || arena_gen != heap_gen)
+		return;
+
+	enter_arena(arena);
+	drain_remote();
+	consolidate();
+	__atomic_store_n((unsigned int *)SHARED_PTR(arena), ARENA_ORPHAN, __ATOMIC_RELEASE);
+	thread_arena = NULL;
+}
+
+/*
+ * arena_malloc - Allocate size bytes from arena, freeing its remote frees first.
+ */
+static void* arena_malloc(void* arena, size_t size)
+{
+	char* bp;
+
+	enter_arena(arena);
+	drain_remote();
+	bp = malloc_arena(size);
+	leave_arena(arena);
+	return bp;
+}
+
+/* 
+ * mm_malloc - Allocate a slab slot for small requests, or a block by finding a fit block,
+ *     in the arena of the calling thread.
+ *     Always allocate a block whose size is a multiple of the alignment.
+ */
+void *mm_malloc(size_t size)
+{
+	void* arena;
+
+	/* Ignore spurious requests */
+	if (size == 0)
+		return NULL;
+
+	/* Huge requests bypass the arenas, whatever their size */
+	if (size >= MMAP_THRESHOLD)
+		return map_block(size, ALIGNMENT);
+
+	if ((arena = get_arena()) == NULL)
+		return NULL;
+	return arena_malloc(arena, size);
+}
+
+/*
+ * mm_free - Give slab slots back to their run, free and coalesce any other block,
+ *     in the arena owning the block. Blocks of another thread's arena are queued to it.
+ *     A NULL bp is ignored.
+ */
+void mm_free(void *bp)
+{
+	int slab;
+	void* arena;
+
+	if (bp == NULL)
+		return;
+	if (IS_MAPPED(bp)) {
+		unmap_block(bp);
+		return;
+	}
+
+	arena = block_arena(bp, &slab);
+	if (!own_arena(arena)) {
+		remote_free(arena, bp);
+		return;
+	}
+
+	enter_arena(arena);
+	free_arena(bp, slab);
+	leave_arena(arena);
+}
+
+/*
+ * mm_free_sized - mm_free for a block last allocated or resized to size bytes. A block
+ *     over SLABLIMIT bytes has never been a slab slot, so the page map is not read.
+ */
+void mm_free_sized(void* bp, size_t size)
+{
+	void* arena;
+
+	if (bp == NULL || size <= SLABLIMIT || IS_MAPPED(bp)) {
+		mm_free(bp);
+		return;
+	}
+
+	arena = GET_FOREIGN(HDRP(bp)) ? GET_P(FTRP(bp)) : heap_listp;
+	if (!own_arena(arena)) {
+		remote_free(arena, bp);
+		return;
+	}
+
+	enter_arena(arena);
+	free_arena(bp, 0);
+	leave_arena(arena);
+}
+
+/*
+ * realloc_fit - Cut allocated block bp down to target bytes, freeing the tail when it is
+ *     large enough for a free block, and mark it for the current arena again.
+ */
+static void realloc_fit(void* bp, size_t target)
+{
+	size_t csize = GET_SIZE(HDRP(bp));
+
+	if (csize >= target + 2 * DSIZE) {
+		PUT(HDRP(bp), PACK(target, GET_PREV_ALLOC(HDRP(bp)) | 1));
+		PUT(HDRP(NEXT_BLKP(bp)), PACK(csize - target, PREV_ALLOC | 1));
+		free_block(NEXT_BLKP(bp));
+	}
+	SET_DIRTY(NEXT_BLKP(bp));
+	if (arena_listp != heap_listp)
+		set_foreign(bp);
+}
+
+/*
+ * realloc_arena - Resize ptr, which belongs to the current arena. Shrink it in place, grow
+ *     it into a free next block (extending the heap when that ends the segment) or a free
+ *     previous block, and move it only when neither is enough, copying only the live payload.
+ */
+static void* realloc_arena(void* ptr, size_t size, int slab)
+{
+	size_t asize, target, csize, nsize, psize, copy;
+	char* next;
+	char* prev;
+	void* newptr;
+
+	/* Slab slots stay put while the request fits the slot, and move out otherwise */
+	if (slab) {
+		size_t slotsize = GET(RUN_SLOTSIZE(RUNP(ptr)));
+
+		if (size <= slotsize)
+			return ptr;
+		if ((newptr = malloc_arena(size)) == NULL)
+			return NULL;
+		memcpy(newptr, ptr, slotsize);
+		slab_free(ptr);
+		return newptr;
+	}
+
+	/* Aligned size, plus the headroom of a block that keeps being resized */
+	asize = ARENA_ASIZE(size);
+	target = asize + (REALLOC_HEADROOM ? ALIGN(asize >> REALLOC_HEADROOM) : 0);
+	csize = GET_SIZE(HDRP(ptr));
+	copy = MIN(PAYLOAD_SIZE(ptr), size);
+
+	/* Fits already: free the tail beyond the headroom */
+	if (asize <= csize) {
+		realloc_fit(ptr, target);
+		return ptr;
+	}
+
+	/* Extend the heap first when the free next block, or ptr itself, ends the segment */
+	next = NEXT_BLKP(ptr);
+	nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+	if (csize + nsize < target && (HDRP(next) == GET_P(TOP_PTR(arena_listp)) ||
+			(nsize != 0 && HDRP(NEXT_BLKP(next)) == GET_P(TOP_PTR(arena_listp))))) {
+		if (extend_heap(MAX(target - csize - nsize, CHUNKSIZE)) == NULL)
+			return NULL;
+		nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+	}
+
+	/* Grow forward into the next block */
+	if (csize + nsize >= asize) {
+		remove_list(next);
+		PUT(HDRP(ptr), PACK(csize + nsize, GET_PREV_ALLOC(HDRP(ptr)) | 1));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+		realloc_fit(ptr, target);
+		return ptr;
+	}
+
+	/* Grow backward into the previous block (and the next one), moving the payload down */
+	if (!GET_PREV_ALLOC(HDRP(ptr)) && (psize = GET_SIZE(HDRP(PREV_BLKP(ptr)))) + csize + nsize >= asize) {
+		prev = PREV_BLKP(ptr);
+		remove_list(prev);
+		if (nsize != 0)
+			remove_list(next);
+		PUT(HDRP(prev), PACK(psize + csize + nsize, GET_PREV_ALLOC(HDRP(prev)) | 1));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(prev)));
+		memmove(prev, ptr, copy);
+		realloc_fit(prev, target);
+		return prev;
+	}
+
+	/* No free neighbour is enough: move the live payload */
+	if ((newptr = malloc_arena(size + (target - asize))) == NULL)
+		return NULL;
+	memcpy(newptr, ptr, copy);
+	free_block(ptr);
+	return newptr;
+}
+
+/*
+ * mm_realloc - Resize ptr within the arena owning it. A block of another thread's arena
+ *     is kept while it is large enough and not shrunk past REMOTE_SHRINK, and moved to
+ *     this thread's arena otherwise, handing the old block back to its owner.
+ */
+void* mm_realloc(void* ptr, size_t size)
+{
+	int slab;
+	void* arena;
+	void* newptr;
+	size_t oldsize;
+
+	/* The corner cases of realloc: plain malloc and free */
+	if (ptr == NULL)
+		return mm_malloc(size);
+	if (size == 0) {
+		mm_free(ptr);
+		return NULL;
+	}
+
+	/* Mapped blocks give back their tail pages when shrunk, and move when grown or when
+	   shrunk below MMAP_THRESHOLD, which copies them into the arena */
+	if (IS_MAPPED(ptr)) {
+		oldsize = MAP_PAYLOAD(ptr);
+		if (size <= oldsize && size >= MMAP_THRESHOLD) {
+			trim_block(ptr, size);
+			return ptr;
+		}
+		if ((newptr = mm_malloc(size)) == NULL)
+			return size <= oldsize ? ptr : NULL;
+		memcpy(newptr, ptr, MIN(oldsize, size));
+		unmap_block(ptr);
+		return newptr;
+	}
+
+	/* Heap blocks never grow past MAXREQUEST: move to a mapping */
+	if (size > MAXREQUEST) {
+		if ((newptr = map_block(size, ALIGNMENT)) == NULL)
+			return NULL;
+		memcpy(newptr, ptr, mm_usable_size(ptr));
+		mm_free(ptr);
+		return newptr;
+	}
+
+	arena = block_arena(ptr, &slab);
+	if (own_arena(arena)) {
+		enter_arena(arena);
+		newptr = realloc_arena(ptr, size, slab);
+		leave_arena(arena);
+		return newptr;
+	}
+
+	/* Payload bytes of ptr: the slot, or the block less its header and owner word */
+	if (slab)
+		oldsize = GET(RUN_SLOTSIZE(RUNP(ptr)));
+	else
+		oldsize = PAYLOAD_SIZE(ptr);
+	/* Only the owner may split the block: the tail of a large shrink is given back by moving */
+	if (size <= oldsize && (slab || size > oldsize >> REMOTE_SHRINK))
+		return ptr;
+
+	if ((arena = get_arena()) == NULL || (newptr = arena_malloc(arena, size)) == NULL)
+		return size <= oldsize ? ptr : NULL;
+	memcpy(newptr, ptr, MIN(oldsize, size));
+	mm_free(ptr);
+	return newptr;
+}
+
+/*
+ * arena_memalign - Allocate size bytes aligned to align bytes from arena, freeing its
+ *     remote frees first.
+ */
+static void* arena_memalign(void* arena, size_t align, size_t size)
+{
+	char* bp;
+
+	enter_arena(arena);
+	drain_remote();
+	if ((bp = alloc_aligned(ARENA_ASIZE(size), align)) != NULL && arena_listp != heap_listp)
+		set_foreign(bp);
+	leave_arena(arena);
+	return bp;
+}
+
+/*
+ * mm_memalign - Allocate size bytes whose payload is aligned to align bytes, a power
+ *     of two, in the arena of the calling thread. The block is carved out of a free
+ *     block past its leading slack, which goes back to the free lists, so mm_free and
+ *     mm_realloc take it like any other block. Huge requests are mapped at an aligned
+ *     offset instead.
+ */
+void* mm_memalign(size_t align, size_t size)
+{
+	void* arena;
+
+	if (align == 0 || (align & (align - 1)) != 0)
+		return NULL;
+
+	/* Every block is aligned this much already */
+	if (align <= ALIGNMENT)
+		return mm_malloc(size);
+
+	/* Ignore spurious requests and map huge ones; the slack of a heap block stays below MAXREQUEST */
+	if (size == 0)
+		return NULL;
+	if (size >= MMAP_THRESHOLD)
+		return map_block(size, align);
+	if (align > MAXREQUEST)
+		return NULL;
+
+	if ((arena = get_arena()) == NULL)
+		return NULL;
+	return arena_memalign(arena, align, size);
+}
+
+/*
+ * mm_aligned_alloc - mm_memalign for a size that is a multiple of align, as in C11.
+ */
+void* mm_aligned_alloc(size_t align, size_t size)
+{
+	if (align == 0 || size % align != 0)
+		return NULL;
+	return mm_memalign(align, size);
+}
+
+/*
+ * mm_arena_create - Create an arena bound to no thread, on the node of the calling thread.
+ *     Any thread allocates from it with mm_arena_malloc and mm_arena_memalign, under its
+ *     lock, and its blocks are freed like any other. Return its index, or -1 if out of
+ *     memory or when there are MAXBOUND of them already.
+ */
+int mm_arena_create(void)
+{
+	void* arena;
+	int idx;
+
+	if (heap_listp == NULL)
+		return -1;
+	lock(HEAPLOCK_PTR);
+	if ((idx = GET(NBOUND_PTR)) >= MAXBOUND || (arena = new_arena(mem_numa_node())) == NULL) {
+		unlock(HEAPLOCK_PTR);
+		return -1;
+	}
+	PUT(SHARED_PTR(arena), ARENA_BOUND);
+	PUT_P(BOUND_PTR(idx), arena);
+
+	/* Lock-free lookups: the count is published after the arena it covers */
+	__atomic_store_n((unsigned int *)NBOUND_PTR, idx + 1, __ATOMIC_RELEASE);
+	unlock(HEAPLOCK_PTR);
+	return idx;
+}
+
+/*
+ * bound_arena - Return the arena of index idx of mm_arena_create, NULL if there is none.
+ */
+static void* bound_arena(int idx)
+{
+	if (heap_listp == NULL || idx < 0 ||
+			idx >= (int)__atomic_load_n((unsigned int *)NBOUND_PTR, __ATOMIC_ACQUIRE))
+		return NULL;
+	return GET_P(BOUND_PTR(idx));
+}
+
+/*
+ * mm_arena_malloc - mm_malloc from the arena of index arena of mm_arena_create.
+ *     Return NULL for an unknown arena.
+ */
+void* mm_arena_malloc(int arena, size_t size)
+{
+	void* bound;
+
+	/* Ignore spurious requests and unknown arenas */
+	if (size == 0 || (bound = bound_arena(arena)) == NULL)
+		return NULL;
+
+	/* Huge requests bypass the arenas, whatever their size */
+	if (size >= MMAP_THRESHOLD)
+		return map_block(size, ALIGNMENT);
+
+	return arena_malloc(bound, size);
+}
+
+/*
+ * mm_arena_memalign - mm_memalign from the arena of index arena of mm_arena_create.
+ *     Return NULL for an unknown arena.
+ */
+void* mm_arena_memalign(int arena, size_t align, size_t size)
+{
+	void* bound;
+
+	if (align == 0 || (align & (align - 1)) != 0)
+		return NULL;
+
+	/* Every block is aligned this much already */
+	if (align <= ALIGNMENT)
+		return mm_arena_malloc(arena, size);
+
+	/* Ignore spurious requests and unknown arenas, and map huge ones as mm_memalign does */
+	if (size == 0 || (bound = bound_arena(arena)) == NULL)
+		return NULL;
+	if (size >= MMAP_THRESHOLD)
+		return map_block(size, align);
+	if (align > MAXREQUEST)
+		return NULL;
+
+	return arena_memalign(bound, align, size);
+}
+
+/*
+ * mm_calloc - Allocate nmemb * size bytes set to zero, in the arena of the calling thread.
+ *     Mapped blocks and blocks cut from the zero top of the arena, memory never handed
+ *     out since the heap got it, are zero already but for the links and the footer of
+ *     the free block they came from. Only recycled blocks are cleared in full.
+ */
+void* mm_calloc(size_t nmemb, size_t size)
+{
+	size_t bytes = nmemb * size;
+	void* arena;
+	char* bp;
+
+	/* Ignore spurious and overflowing requests */
+	if (bytes == 0 || bytes / size != nmemb)
+		return NULL;
+
+	/* Huge requests get fresh pages, whatever their size */
+	if (bytes >= MMAP_THRESHOLD)
+		return map_block(bytes, ALIGNMENT);
+
+	if ((arena = get_arena()) == NULL)
+		return NULL;
+	enter_arena(arena);
+	drain_remote();
+	cut_zero = NULL;
+	bp = malloc_arena(bytes);
+	leave_arena(arena);
+
+	/* Slab slots and quick list blocks are recycled */
+	if (bp == NULL)
+		return NULL;
+	if (bytes < SLABLIMIT || cut_zero == NULL || bp < cut_zero)
+		memset(bp, 0, bytes);
+	else {
+		PUT(PRED_PTR(bp), 0);
+		PUT(SUCC_PTR(bp), 0);
+		if (!GET_FOREIGN(HDRP(bp)))
+			PUT(FTRP(bp), 0);
+	}
+	return bp;
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes at once into out, in the arena of the
+ *     calling thread, and return how many were allocated. Blocks carved together are
+ *     contiguous, so mm_free_batch merges them back in one pass.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void** out)
+{
+	void* arena;
+	size_t i = 0;
+
+	/* Ignore spurious requests */
+	if (size == 0)
+		return 0;
+
+	/* Huge requests bypass the arenas, whatever their size */
+	if (size >= MMAP_THRESHOLD) {
+		while (i < n && (out[i] = map_block(size, ALIGNMENT)) != NULL)
+			i++;
+		return i;
+	}
+
+	if ((arena = get_arena()) == NULL)
+		return 0;
+	enter_arena(arena);
+	drain_remote();
+	i = malloc_batch(size, n, out);
+	leave_arena(arena);
+	return i;
+}
+
+/*
+ * ptr_cmp - Order two pointers by address for qsort.
+ */
+static int ptr_cmp(const void* a, const void* b)
+{
+	char* p = *(char * const *)a;
+	char* q = *(char * const *)b;
+
+	return (p > q) - (p < q);
+}
+
+/*
+ * mm_free_batch - Free the n blocks of ptrs, which is sorted by address on the way. Blocks
+ *     that follow each other in memory are joined into one free block, which is coalesced
+ *     once, and every arena is entered once per run of its blocks.
+ */
+void mm_free_batch(void** ptrs, size_t n)
+{
+	size_t i, j, size;
+	int slab, next_slab;
+	void* arena;
+	char* bp;
+
+	qsort(ptrs, n, sizeof(void*), ptr_cmp);
+	for (i = 0; i < n; i = j) {
+		bp = ptrs[i];
+		j = i + 1;
+		if (bp == NULL)
+			continue;
+		if (IS_MAPPED(bp)) {
+			unmap_block(bp);
+			continue;
+		}
+
+		arena = block_arena(bp, &slab);
+		if (!own_arena(arena)) {
+			remote_free(arena, bp);
+			continue;
+		}
+
+		enter_arena(arena);
+		for (;;) {
+			/* Take in the blocks right after bp */
+			for (size = GET_SIZE(HDRP(bp)); !slab && j < n && (char *)ptrs[j] == bp + size &&
+					page_tag(ptrs[j]) != PAGE_SLAB; j++)
+				size += GET_SIZE(HDRP(ptrs[j]));
+			if (size != GET_SIZE(HDRP(bp))) {
+				PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)) | 1));
+				free_block(bp);
+			}
+			else
+				free_arena(bp, slab);
+
+			/* Go on while the next block is in the same arena */
+			if (j == n || IS_MAPPED(bp = ptrs[j]) || block_arena(bp, &next_slab) != arena)
+				break;
+			slab = next_slab;
+			j++;
+		}
+		leave_arena(arena);
+	}
+}
+
+/*
+ * mm_usable_size - Return the bytes the allocated block ptr can hold: its slot, its
+ *     mapping or its block, less the overhead.
+ */
+size_t mm_usable_size(void* ptr)
+{
+	if (ptr == NULL)
+		return 0;
+	if (IS_MAPPED(ptr))
+		return MAP_PAYLOAD(ptr);
+	if (page_tag(ptr) == PAGE_SLAB)
+		return GET(RUN_SLOTSIZE(RUNP(ptr)));
+	return PAYLOAD_SIZE(ptr);
+}
+
+/*
+ * mm_alignment - Return the alignment of every block, as built: ALIGNMENT, which is 16
+ *     for libmm.so and 8 by default.
+ */
+size_t mm_alignment(void)
+{
+	return ALIGNMENT;
+}
+
+/*
+ * mm_fork_prepare - Take the lock of every arena, then the heap lock, in the order of the
+ *     other threads, for a fork of the calling thread. An arena created meanwhile goes in
+ *     at the head of the list under the heap lock, so the locks are taken over then.
+ */
+void mm_fork_prepare(void)
+{
+	void* first;
+	void* arena;
+
+	if (heap_listp == NULL)
+		return;
+	for (;;) {
+		first = GET_P(NEXT_ARENA(heap_listp));
+		for (arena = heap_listp; arena != NULL; arena = GET_P(NEXT_ARENA(arena)))
+			lock(LOCK_PTR(arena));
+		lock(HEAPLOCK_PTR);
+		if (GET_P(NEXT_ARENA(heap_listp)) == first)
+			return;
+		mm_fork_parent();
+	}
+}
+
+/*
+ * mm_fork_parent - Release the locks of mm_fork_prepare after a fork.
+ */
+void mm_fork_parent(void)
+{
+	void* arena;
+
+	if (heap_listp == NULL)
+		return;
+	unlock(HEAPLOCK_PTR);
+	for (arena = heap_listp; arena != NULL; arena = GET_P(NEXT_ARENA(arena)))
+		unlock(LOCK_PTR(arena));
+}
+
+/*
+ * mm_fork_child - Release the locks of mm_fork_prepare in the child, where the calling
+ *     thread is the only one left. The arenas of the other threads stay theirs: they may
+ *     have been halfway through an operation, so blocks freed into them are only queued.
+ */
+void mm_fork_child(void)
+{
+	mm_fork_parent();
+}
+
+/*
+ * stat_free - Count free block bp into its size class of hs.
+ */
+static void stat_free(heapstats_t* hs, void* bp)
+{
+	size_t size = GET_SIZE(HDRP(bp));
+	int class_idx = CLASS_IDX(size);
+
+	hs->free_blocks++;
+	hs->free_bytes += size;
+	hs->class_blocks[class_idx]++;
+	hs->class_bytes[class_idx] += size;
+	hs->largest_free = MAX(hs->largest_free, size);
+}
+
+/*
+ * stat_segment - Count the blocks of the heap segment whose first block is bp into hs.
+ *     Slab runs are told apart by the page map, and counted by their slots.
+ */
+static void stat_segment(heapstats_t* hs, char* bp)
+{
+	size_t size, slotsize;
+
+	for (; (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+		if (!GET_ALLOC(HDRP(bp))) {
+			stat_free(hs, bp);
+			hs->tag_bytes += DSIZE;
+		}
+		else if (bp == RUNP(bp) && page_tag(bp) == PAGE_SLAB) {
+			slotsize = GET(RUN_SLOTSIZE(bp));
+			hs->slab_runs++;
+			hs->slab_used += (GET(RUN_NSLOTS(bp)) - GET(RUN_NFREE(bp))) * slotsize;
+			hs->slab_free += GET(RUN_NFREE(bp)) * slotsize;
+			hs->tag_bytes += WSIZE;
+		}
+		else {
+			hs->alloc_blocks++;
+			hs->alloc_bytes += size;
+			hs->tag_bytes += GET_FOREIGN(HDRP(bp)) ? DSIZE : WSIZE;
+		}
+	}
+}
+
+/*
+ * stat_waiting - Move the blocks freed but still marked allocated, in the quick lists and
+ *     remote free queue of the current arena, from the allocated ones of hs to their own counts.
+ */
+static void stat_waiting(heapstats_t* hs)
+{
+	size_t slotsize;
+	char* bp;
+	int i;
+
+	for (i = 0; i < NQUICK; i++) {
+		for (bp = GET_P(QUICK_PTR(i)); bp != NULL; bp = GET_P(bp)) {
+			hs->quick_blocks++;
+			hs->quick_bytes += GET_SIZE(HDRP(bp));
+			hs->alloc_blocks--;
+			hs->alloc_bytes -= GET_SIZE(HDRP(bp));
+		}
+	}
+	for (bp = GET_P(REMOTE_PTR(arena_listp)); bp != NULL; bp = GET_P(bp)) {
+		hs->remote_blocks++;
+		if (page_tag(bp) == PAGE_SLAB) {
+			slotsize = GET(RUN_SLOTSIZE(RUNP(bp)));
+			hs->slab_used -= slotsize;
+			hs->slab_free += slotsize;
+		}
+		else {
+			hs->alloc_blocks--;
+			hs->alloc_bytes -= GET_SIZE(HDRP(bp));
+		}
+	}
+}
+
+/*
+ * mm_heapstats - Fill hs in with the statistics of the whole heap, walking every segment
+ *     and the quick lists and remote free queue of every arena. Mapped blocks are not
+ *     part of the heap. No other thread may be in the allocator meanwhile. Return -1
+ *     before mm_init.
+ */
+int mm_heapstats(heapstats_t* hs)
+{
+	void* saved = arena_listp;
+	void* arena;
+	char* seg;
+	size_t size, step;
+	int class_idx;
+
+	if (heap_listp == NULL)
+		return -1;
+	memset(hs, 0, sizeof(*hs));
+
+	/* Smallest size of each class, stepping from class bound to class bound */
+	hs->nclass = MAXCLASS;
+	for (size = 2 * DSIZE, class_idx = -1; class_idx < MAXCLASS - 1; size += step) {
+		if (CLASS_IDX(size) != class_idx)
+			hs->class_min[class_idx = CLASS_IDX(size)] = size;
+		step = size < LISTLIMIT ? DSIZE : MAX(DSIZE, (size_t)1 << (CLASS_LOG(size) - CLASS_SHIFT));
+	}
+
+	lock(HEAPLOCK_PTR);
+	hs->heap_size = mem_heapsize();
+	hs->extends = heap_extends;
+
+	/* The main segment starts after the prologue, the others after their padding */
+	stat_segment(hs, heap_listp + (LISTWORDS + 3) * WSIZE);
+	for (seg = GET_P(SEGS_PTR); seg != NULL; seg = GET_P(seg))
+		stat_segment(hs, seg + ALIGNMENT);
+
+	for (arena = heap_listp; arena != NULL; arena = GET_P(NEXT_ARENA(arena))) {
+		arena_listp = arena;
+		stat_waiting(hs);
+		hs->arenas++;
+	}
+	arena_listp = saved;
+	unlock(HEAPLOCK_PTR);
+
+	hs->ext_frag = hs->free_bytes > 0 ? 1.0 - (double)hs->largest_free / hs->free_bytes : 0;
+	return 0;
 }
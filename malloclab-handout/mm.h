@@ -3,7 +3,56 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern size_t mm_usable_size(void *ptr);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+extern size_t mm_alignment(void);
+
+/* Arenas bound to no thread, by index, for any thread to allocate from */
+extern int mm_arena_create(void);
+extern void *mm_arena_malloc(int arena, size_t size);
+extern void *mm_arena_memalign(int arena, size_t align, size_t size);
+
+/* Fork handlers for pthread_atfork: the child gets the locks of the heap free */
+extern void mm_fork_prepare(void);
+extern void mm_fork_parent(void);
+extern void mm_fork_child(void);
+
+/*
+ * Heap statistics filled in by mm_heapstats. Block sizes include their
+ * boundary tags; the size classes are those of the free lists.
+ */
+#define MM_MAXCLASS 32
+
+typedef struct {
+    size_t heap_size;      /* bytes of the heap, all regions */
+    int arenas;            /* arenas in the heap */
+    size_t extends;        /* times the heap was extended since mm_init */
+    size_t alloc_blocks;   /* allocated blocks, slab runs not included */
+    size_t alloc_bytes;
+    size_t free_blocks;    /* free blocks, in the size classes */
+    size_t free_bytes;
+    size_t largest_free;   /* largest free block */
+    double ext_frag;       /* 1 - largest_free / free_bytes (0 if nothing is free) */
+    size_t tag_bytes;      /* headers, footers and owner words of all blocks */
+    int nclass;            /* size classes in the arrays below */
+    size_t class_min[MM_MAXCLASS];    /* smallest block size of each class */
+    size_t class_blocks[MM_MAXCLASS]; /* free blocks of each class */
+    size_t class_bytes[MM_MAXCLASS];
+    size_t slab_runs;      /* slab runs, and the bytes of their slots in use and free */
+    size_t slab_used;
+    size_t slab_free;
+    size_t quick_blocks;   /* freed blocks waiting in quick lists */
+    size_t quick_bytes;
+    size_t remote_blocks;  /* frees waiting in remote free queues */
+} heapstats_t;
+
+extern int mm_heapstats(heapstats_t *hs);
 
 
 /* 
@@ -0,0 +1,173 @@
+/*
+ * mm_resource.hpp - C++ adapters over mm.c: mm::resource, a std::pmr::memory_resource,
+ *     and mm::allocator<T>, an allocator for the standard containers. Both hand the
+ *     size back on deallocation, so blocks over SLABLIMIT bytes are freed by
+ *     mm_free_sized without a page map lookup. The heap must be set up first
+ *     (mem_init and mm_init), as for mdriver. C++17.
+ *
+ *     std::pmr::map<int, int> m(mm::default_resource());
+ *     std::list<int, mm::allocator<int> > l;
+ *
+ * Blocks come from the arena of the calling thread, or for mm::arena_resource
+ * from an arena of mm_arena_create, shared by every thread that uses it:
+ *
+ *     mm::arena_resource r;
+ *     std::pmr::list<int> l(&r);
+ */
+#ifndef MM_RESOURCE_HPP
+#define MM_RESOURCE_HPP
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <memory_resource>
+
+extern "C" {
+#include "mm.h"
+}
+
+namespace mm {
+
+/*
+ * allocate - Allocate bytes aligned to align, throwing std::bad_alloc when out of memory.
+ *     Alignments stricter than that of every block, as built, go to mm_memalign. Zero
+ *     bytes take the smallest block, so that every result is distinct.
+ */
+inline void* allocate(std::size_t bytes, std::size_t align)
+{
+	void* p;
+
+	if (bytes == 0)
+		bytes = 1;
+	p = align <= mm_alignment() ? mm_malloc(bytes) : mm_memalign(align, bytes);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+/*
+ * deallocate - Free p of allocate(bytes, ...).
+ */
+inline void deallocate(void* p, std::size_t bytes) noexcept
+{
+	mm_free_sized(p, bytes != 0 ? bytes : 1);
+}
+
+/*
+ * resource - A memory resource on mm.c. All of them draw on the same heap and are equal.
+ */
+class resource : public std::pmr::memory_resource {
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		return mm::allocate(bytes, align);
+	}
+
+	void do_deallocate(void* p, std::size_t bytes, std::size_t) override
+	{
+		mm::deallocate(p, bytes);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return dynamic_cast<const resource*>(&other) != nullptr;
+	}
+};
+
+/*
+ * arena_resource - A memory resource on an arena of mm_arena_create, a new one or one
+ *     given by its index. Resources on the same arena are equal.
+ */
+class arena_resource : public std::pmr::memory_resource {
+public:
+	arena_resource() : arena_(mm_arena_create())
+	{
+		if (arena_ < 0)
+			throw std::bad_alloc();
+	}
+
+	explicit arena_resource(int arena) noexcept : arena_(arena) {}
+
+	/* Index of the arena, for mm_arena_malloc or another arena_resource */
+	int arena() const noexcept
+	{
+		return arena_;
+	}
+
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		void* p;
+
+		if (bytes == 0)
+			bytes = 1;
+		p = align <= mm_alignment() ? mm_arena_malloc(arena_, bytes) : mm_arena_memalign(arena_, align, bytes);
+		if (p == nullptr)
+			throw std::bad_alloc();
+		return p;
+	}
+
+	void do_deallocate(void* p, std::size_t bytes, std::size_t) override
+	{
+		mm::deallocate(p, bytes);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		const arena_resource* r = dynamic_cast<const arena_resource*>(&other);
+
+		return r != nullptr && r->arena_ == arena_;
+	}
+
+private:
+	int arena_;
+};
+
+/*
+ * default_resource - The resource to hand to std::pmr containers.
+ */
+inline resource* default_resource() noexcept
+{
+	static resource r;
+	return &r;
+}
+
+/*
+ * allocator - A stateless allocator of T on mm.c.
+ */
+template <class T>
+class allocator {
+public:
+	typedef T value_type;
+
+	allocator() noexcept {}
+	template <class U> allocator(const allocator<U>&) noexcept {}
+
+	T* allocate(std::size_t n)
+	{
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+		return static_cast<T*>(mm::allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T* p, std::size_t n) noexcept
+	{
+		mm::deallocate(p, n * sizeof(T));
+	}
+};
+
+template <class T, class U>
+inline bool operator==(const allocator<T>&, const allocator<U>&) noexcept
+{
+	return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const allocator<T>&, const allocator<U>&) noexcept
+{
+	return false;
+}
+
+} /* namespace mm */
+
+#endif /* MM_RESOURCE_HPP */
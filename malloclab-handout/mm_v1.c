@@ -69,6 +69,7 @@ team_t team = {
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
 void* heap_listp;	/* heap list pointer */
+static size_t heap_extends;	/* heap extensions since mm_init */
 
 static void* coalesce(void* bp)
 {
@@ -111,6 +112,7 @@ static void* extend_heap(size_t words)
 	size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
 	if ((long)(bp = mem_sbrk(size)) == -1)
 		return NULL;
+	heap_extends++;
 
 	/* Initialize free block header/footer and the epilogue header */
 	PUT(HDRP(bp), PACK(size, 0));			/* Free block header */
@@ -163,6 +165,7 @@ int mm_init(void)
 	PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1));	/* Prologue footer */
 	PUT(heap_listp + (3 * WSIZE), PACK(0, 1));		/* Epilogue header */
 	heap_listp += (2 * WSIZE);
+	heap_extends = 0;
 
 	/* Extend the empty heap with a free block of CHUNKSIZE bytes */
 	if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
@@ -235,3 +238,39 @@ void *mm_realloc(void *ptr, size_t size)
 	mm_free(oldptr);
 	return newptr;
 }
+
+/*
+ * mm_heapstats - Fill hs in with the statistics of the heap, walking the
+ *     implicit list. All free blocks are in one class.
+ */
+int mm_heapstats(heapstats_t *hs)
+{
+	void* bp;
+	size_t size;
+
+	if (heap_listp == NULL)
+		return -1;
+	memset(hs, 0, sizeof(*hs));
+	hs->heap_size = mem_heapsize();
+	hs->arenas = 1;
+	hs->extends = heap_extends;
+	hs->nclass = 1;
+	hs->class_min[0] = 2 * DSIZE;
+
+	for (bp = NEXT_BLKP(heap_listp); (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+		hs->tag_bytes += DSIZE;
+		if (GET_ALLOC(HDRP(bp))) {
+			hs->alloc_blocks++;
+			hs->alloc_bytes += size;
+		}
+		else {
+			hs->free_blocks++;
+			hs->free_bytes += size;
+			hs->largest_free = MAX(hs->largest_free, size);
+		}
+	}
+	hs->class_blocks[0] = hs->free_blocks;
+	hs->class_bytes[0] = hs->free_bytes;
+	hs->ext_frag = hs->free_bytes > 0 ? 1.0 - (double)hs->largest_free / hs->free_bytes : 0;
+	return 0;
+}
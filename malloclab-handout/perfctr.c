@@ -0,0 +1,118 @@
+/*
+ * perfctr.c - Count the hardware events caused by a function f with the
+ *     Linux perf_event_open interface: instructions, cache and TLB misses,
+ *     branch misses and page faults, in user mode only.
+ *
+ * Each event has a counter of its own, so that the events the processor
+ * (or a virtual machine) does not provide are reported as missing rather
+ * than failing the whole set. When the kernel multiplexes more counters
+ * than the PMU holds, the counts are scaled up to the time enabled.
+ * Elsewhere than on Linux no event is counted.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "perfctr.h"
+
+/* Generic cache event: cache id, operation and result */
+#define CACHE_EVENT(cache, op, result) ((cache) | ((op) << 8) | ((result) << 16))
+
+/* File descriptor of each counter, -1 if it could not be opened */
+static int fds[PERFCTR_NUM] = {-1, -1, -1, -1, -1, -1};
+
+static char *names[PERFCTR_NUM] = {
+    "instrs", "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss", "faults"
+};
+
+/*
+ * perfctr_init - Open one disabled counter per event for the calling
+ *     thread. Return the number of counters opened.
+ */
+int perfctr_init(void)
+{
+    int n = 0;
+#ifdef __linux__
+    static const struct { unsigned type; unsigned long long config; } events[PERFCTR_NUM] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, 
+	    PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, 
+	    PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}
+    };
+    struct perf_event_attr attr;
+    int i;
+
+    for (i = 0; i < PERFCTR_NUM; i++) {
+	if (fds[i] >= 0)
+	    close(fds[i]);
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+    }
+#endif
+    return n;
+}
+
+/*
+ * perfctr_name - Return the short name of event i
+ */
+char *perfctr_name(int i)
+{
+    return names[i];
+}
+
+/*
+ * perfctr_run - Run f(argp) n times with the counters enabled, and store
+ *     the average count of each event per run in counts (-1 for the events
+ *     that are not counted).
+ */
+void perfctr_run(perfctr_test_funct f, void *argp, int n, double *counts)
+{
+    int i, j;
+#ifdef __linux__
+    unsigned long long value[3];  /* count, time enabled, time running */
+
+    for (i = 0; i < PERFCTR_NUM; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+    for (i = 0; i < PERFCTR_NUM; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    for (j = 0; j < n; j++)
+	f(argp);
+#ifdef __linux__
+    for (i = 0; i < PERFCTR_NUM; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+
+    for (i = 0; i < PERFCTR_NUM; i++) {
+	counts[i] = -1;
+#ifdef __linux__
+	if (fds[i] < 0 || read(fds[i], value, sizeof(value)) != sizeof(value))
+	    continue;
+	counts[i] = (double)value[0] / n;
+	if (value[2] != 0 && value[2] < value[1])
+	    counts[i] *= (double)value[1] / value[2];
+	else if (value[2] == 0 && value[1] != 0)
+	    counts[i] = -1;       /* never scheduled on the PMU */
+#endif
+    }
+}
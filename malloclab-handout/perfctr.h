@@ -0,0 +1,26 @@
+/*
+ * perfctr.h - prototypes for the routines in perfctr.c that count the
+ *     hardware events caused by a test function f
+ */
+typedef void (*perfctr_test_funct)(void *);
+
+/* The events counted, in the order of the counts of perfctr_run */
+enum {
+    PERFCTR_INSTRS,       /* instructions retired */
+    PERFCTR_L1D_MISSES,   /* L1 data cache read misses */
+    PERFCTR_LLC_MISSES,   /* last level cache misses */
+    PERFCTR_DTLB_MISSES,  /* data TLB read misses */
+    PERFCTR_BR_MISSES,    /* mispredicted branches */
+    PERFCTR_FAULTS,       /* page faults */
+    PERFCTR_NUM
+};
+
+/* Open the counters. Return how many of them the system provides */
+int perfctr_init(void);
+
+/* Short name of event i, for table headers */
+char *perfctr_name(int i);
+
+/* Run f(argp) n times with the counters on and store the average count
+   of each event per run in counts, or -1 where the event is not counted */
+void perfctr_run(perfctr_test_funct f, void *argp, int n, double *counts);
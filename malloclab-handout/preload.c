@@ -0,0 +1,139 @@
+/*
+ * preload.c - The C library allocation functions on top of mm.c, to be loaded with
+ *     LD_PRELOAD in place of the libc malloc. The heap is memlib's virtual memory
+ *     backend, set up by the first call. Build it with "make libmm.so", which
+ *     builds mm.c with an ALIGNMENT of 16 bytes, as glibc gives on 64-bit hosts.
+ *     Fork handlers take the locks of the heap, so that a fork while another
+ *     thread holds one does not leave it held in the child.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* 0 before the heap is set up, 1 while a thread sets it up, 2 once it is ready */
+static int heap_state;
+
+/*
+ * heap_setup - Set up memlib and mm.c once, and their fork handlers; the other threads
+ *     wait for it.
+ */
+static void heap_setup(void)
+{
+	if (__sync_bool_compare_and_swap(&heap_state, 0, 1)) {
+		mem_init();
+		if (mm_init() < 0 || pthread_atfork(mm_fork_prepare, mm_fork_parent, mm_fork_child) != 0)
+			abort();
+		__atomic_store_n(&heap_state, 2, __ATOMIC_RELEASE);
+	}
+	while (__atomic_load_n(&heap_state, __ATOMIC_ACQUIRE) != 2)
+		sched_yield();
+}
+
+/* Set up the heap on the first call */
+#define SETUP() do { if (__atomic_load_n(&heap_state, __ATOMIC_ACQUIRE) != 2) heap_setup(); } while (0)
+
+/* Return p, setting errno if it is NULL */
+#define CHECKED(p) ((p) != NULL ? (p) : (errno = ENOMEM, (void *)NULL))
+
+/*
+ * malloc - mm_malloc, which gives nothing for 0 bytes: a zero size takes the smallest
+ *     block, as glibc does.
+ */
+EXPORT void* malloc(size_t size)
+{
+	void* p;
+
+	SETUP();
+	p = mm_malloc(size != 0 ? size : 1);
+	return CHECKED(p);
+}
+
+EXPORT void free(void* ptr)
+{
+	if (ptr != NULL)
+		mm_free(ptr);
+}
+
+EXPORT void* calloc(size_t nmemb, size_t size)
+{
+	void* p;
+
+	SETUP();
+	if (nmemb == 0 || size == 0)
+		nmemb = size = 1;
+	p = mm_calloc(nmemb, size);
+	return CHECKED(p);
+}
+
+/*
+ * realloc - mm_realloc, which frees ptr for 0 bytes and takes NULL as a malloc.
+ */
+EXPORT void* realloc(void* ptr, size_t size)
+{
+	void* p;
+
+	SETUP();
+	if ((p = mm_realloc(ptr, ptr == NULL && size == 0 ? 1 : size)) == NULL && size != 0)
+		errno = ENOMEM;
+	return p;
+}
+
+EXPORT void* memalign(size_t align, size_t size)
+{
+	void* p;
+
+	SETUP();
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	p = mm_memalign(align, size != 0 ? size : 1);
+	return CHECKED(p);
+}
+
+/*
+ * aligned_alloc - memalign with any size, as glibc does, not only multiples of align.
+ */
+EXPORT void* aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+EXPORT int posix_memalign(void** memptr, size_t align, size_t size)
+{
+	void* p;
+
+	SETUP();
+	if (align % sizeof(void*) != 0 || (align & (align - 1)) != 0)
+		return EINVAL;
+	if ((p = mm_memalign(align, size != 0 ? size : 1)) == NULL)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+EXPORT void* valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void* pvalloc(size_t size)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void* ptr)
+{
+	return mm_usable_size(ptr);
+}
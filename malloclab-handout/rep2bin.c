@@ -0,0 +1,87 @@
+/*
+ * rep2bin.c - Convert a text .rep trace to the packed binary format of
+ *     tracebin.h, one request at a time, so that traces of any length
+ *     convert in constant memory.
+ *
+ *     usage: rep2bin <in.rep> <out>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tracebin.h"
+
+#define MAXLINE 1024
+
+/*
+ * fail - Print msg about path and exit
+ */
+static void fail(char *msg, char *path)
+{
+    fprintf(stderr, "rep2bin: %s: %s\n", path, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    char type[MAXLINE];
+    unsigned char buf[3 * TRACEBIN_MAXVARINT], *p;
+    int header[4];
+    unsigned index, size, last = 0, ops = 0;
+    int i, t;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <in.rep> <out>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+	fail("could not open", argv[1]);
+    if ((out = fopen(argv[2], "wb")) == NULL)
+	fail("could not create", argv[2]);
+
+    /* sugg_heapsize, num_ids, num_ops, weight */
+    fwrite(TRACEBIN_MAGIC, 1, TRACEBIN_MAGICLEN, out);
+    for (i = 0; i < 4; i++) {
+	if (fscanf(in, "%d", &header[i]) != 1 || header[i] < 0)
+	    fail("bad header", argv[1]);
+	p = tracebin_put(buf, header[i]);
+	fwrite(buf, 1, p - buf, out);
+    }
+
+    while (fscanf(in, "%s", type) != EOF) {
+	size = 0;
+	switch (type[0]) {
+	case 'a':
+	    t = TRACEBIN_ALLOC;
+	    break;
+	case 'r':
+	    t = TRACEBIN_REALLOC;
+	    break;
+	case 'f':
+	    t = TRACEBIN_FREE;
+	    break;
+	default:
+	    fail("bogus request type", argv[1]);
+	}
+	if ((t == TRACEBIN_FREE ? fscanf(in, "%u", &index) != 1 :
+	     fscanf(in, "%u %u", &index, &size) != 2) ||
+	    index >= (unsigned)header[1])
+	    fail("bad request", argv[1]);
+	if (TRACEBIN_ZIGZAG(index - last) > TRACEBIN_MAXDELTA)
+	    fail("index step too large", argv[1]);
+
+	p = tracebin_put(buf, TRACEBIN_ZIGZAG(index - last) << 2 | t);
+	if (t != TRACEBIN_FREE)
+	    p = tracebin_put(p, size);
+	fwrite(buf, 1, p - buf, out);
+	last = index;
+	ops++;
+    }
+    if (ops != (unsigned)header[2])
+	fail("request count differs from the header", argv[1]);
+
+    fclose(in);
+    if (fclose(out) != 0)
+	fail("write failed", argv[2]);
+    return 0;
+}
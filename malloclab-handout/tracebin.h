@@ -0,0 +1,76 @@
+/*
+ * tracebin.h - The packed binary trace format, which mdriver maps and reads
+ *     in place as it replays, where it parses a .rep trace into an array of
+ *     requests. rep2bin writes it from a .rep trace.
+ *
+ *     TRACEBIN_MAGIC
+ *     sugg_heapsize num_ids num_ops weight      as in the .rep header
+ *     num_ops requests, each of
+ *         tag                 delta << 2 | type
+ *         size                for TRACEBIN_ALLOC and TRACEBIN_REALLOC only
+ *
+ * Every number is a varint: 7 bits a byte, low bits first, the high bit set
+ * on every byte but the last. delta is the block index less the index of
+ * the request before (0 for the first one), zigzag coded so that small
+ * steps either way take one byte.
+ */
+#ifndef TRACEBIN_H
+#define TRACEBIN_H
+
+#define TRACEBIN_MAGIC    "MMTRACE1"
+#define TRACEBIN_MAGICLEN 8
+
+/* The request types of a tag, in the order of traceop_t in mdriver.c */
+#define TRACEBIN_ALLOC    0
+#define TRACEBIN_FREE     1
+#define TRACEBIN_REALLOC  2
+
+/* Longest varint of 32 bits */
+#define TRACEBIN_MAXVARINT 5
+
+/* Largest zigzag coded delta that fits a tag */
+#define TRACEBIN_MAXDELTA  0x3fffffffu
+
+/* Zigzag code of an index delta, and back */
+#define TRACEBIN_ZIGZAG(d)   (((unsigned int)(d) << 1) ^ (0u - ((unsigned int)(d) >> 31)))
+#define TRACEBIN_UNZIGZAG(z) ((int)(((z) >> 1) ^ (0u - ((z) & 1))))
+
+/*
+ * tracebin_put - Write varint v at p, return the end of it.
+ */
+static inline unsigned char *tracebin_put(unsigned char *p, unsigned int v)
+{
+    while (v >= 0x80) {
+	*p++ = (unsigned char)(v | 0x80);
+	v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+/*
+ * tracebin_get - Read the varint at p into *v, return the end of it. The
+ *     varint must lie before end and be at most TRACEBIN_MAXVARINT bytes
+ *     long, else the result is NULL. A trace checked once can be read with
+ *     end NULL, which takes out the bound.
+ */
+static inline const unsigned char *tracebin_get(const unsigned char *p,
+						const unsigned char *end,
+						unsigned int *v)
+{
+    unsigned int x = 0;
+    int shift;
+
+    for (shift = 0; shift < 7 * TRACEBIN_MAXVARINT; shift += 7) {
+	if (end != NULL && p >= end)
+	    return NULL;
+	x |= (unsigned int)(*p & 0x7f) << shift;
+	if ((*p++ & 0x80) == 0) {
+	    *v = x;
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+#endif /* TRACEBIN_H */